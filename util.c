@@ -2,11 +2,43 @@
 
 #include <err.h>
 #include <errno.h>
+#include <grp.h>
+#include <pwd.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "util.h"
 
+#define IDBUCKETS       64
+#define ARENA_BLOCKSIZE (64 * 1024)
+
+/*
+ * An arena is a list of blocks from which memory is taken in order.
+ * Nothing is freed individually; resetting an arena just makes it be
+ * allocated again from its first block, keeping all the blocks around
+ * for reuse.
+ */
+struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size, used;
+	char data[];
+};
+
+struct IdName {
+	struct IdName *next;
+	unsigned long id;
+	char *name;             /* NULL if id has no name */
+};
+
+/*
+ * Names of users and groups, as looked up with getpwuid(3) and
+ * getgrgid(3).  Those can be slow (for example, when the database is
+ * on a LDAP server); and the same few ids are asked for over and over.
+ * Unknown ids are remembered too, so they are not looked up again.
+ */
+static struct IdName *usernames[IDBUCKETS];
+static struct IdName *groupnames[IDBUCKETS];
+
 int
 max(int x, int y)
 {
@@ -73,16 +105,6 @@ egetcwd(char *path, size_t size)
 	}
 }
 
-int
-escandir(const char *dirname, struct dirent ***namelist, int (*select)(const struct dirent *), int (*compar)(const struct dirent **, const struct dirent **))
-{
-	int ret;
-
-	if ((ret = scandir(dirname, namelist, select, compar)) == -1)
-		err(EXIT_FAILURE, "scandir");
-	return ret;
-}
-
 pid_t
 efork(void)
 {
@@ -122,6 +144,17 @@ etjoin(pthread_t tid, void **rval)
 	}
 }
 
+void
+etdetach(pthread_t tid)
+{
+	int errn;
+
+	if ((errn = pthread_detach(tid)) != 0) {
+		errno = errn;
+		err(EXIT_FAILURE, "could not detach thread");
+	}
+}
+
 void
 etlock(pthread_mutex_t *mutex)
 {
@@ -144,6 +177,28 @@ etunlock(pthread_mutex_t *mutex)
 	}
 }
 
+void
+etwait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	int errn;
+
+	if ((errn = pthread_cond_wait(cond, mutex)) != 0) {
+		errno = errn;
+		err(EXIT_FAILURE, "could not wait on condition");
+	}
+}
+
+void
+etsignal(pthread_cond_t *cond)
+{
+	int errn;
+
+	if ((errn = pthread_cond_signal(cond)) != 0) {
+		errno = errn;
+		err(EXIT_FAILURE, "could not signal condition");
+	}
+}
+
 int
 ewaitpid(pid_t pid)
 {
@@ -169,3 +224,126 @@ eclose(int fd)
 		}
 	}
 }
+
+static struct IdName **
+idlookup(struct IdName **table, unsigned long id)
+{
+	struct IdName **p;
+
+	for (p = &table[id % IDBUCKETS]; *p != NULL; p = &(*p)->next)
+		if ((*p)->id == id)
+			break;
+	return p;
+}
+
+static const char *
+idinsert(struct IdName **p, unsigned long id, const char *name)
+{
+	*p = emalloc(sizeof(**p));
+	**p = (struct IdName){
+		.next = NULL,
+		.id = id,
+		.name = (name != NULL) ? estrdup(name) : NULL,
+	};
+	return (*p)->name;
+}
+
+const char *
+username(uid_t uid)
+{
+	struct IdName **p;
+	struct passwd *pw;
+
+	if (*(p = idlookup(usernames, uid)) != NULL)
+		return (*p)->name;
+	pw = getpwuid(uid);
+	return idinsert(p, uid, pw != NULL ? pw->pw_name : NULL);
+}
+
+const char *
+groupname(gid_t gid)
+{
+	struct IdName **p;
+	struct group *gr;
+
+	if (*(p = idlookup(groupnames, gid)) != NULL)
+		return (*p)->name;
+	gr = getgrgid(gid);
+	return idinsert(p, gid, gr != NULL ? gr->gr_name : NULL);
+}
+
+char *
+arenaalloc(struct Arena *arena, size_t size)
+{
+	struct ArenaBlock *block;
+	char *p;
+
+	while (arena->curr == NULL || arena->curr->used + size > arena->curr->size) {
+		if (arena->curr != NULL && arena->curr->next != NULL) {
+			/* reuse block left from before a reset */
+			arena->curr = arena->curr->next;
+			arena->curr->used = 0;
+			continue;
+		}
+		if (size > ARENA_BLOCKSIZE)
+			block = emalloc(sizeof(*block) + size);
+		else
+			block = emalloc(sizeof(*block) + ARENA_BLOCKSIZE);
+		block->next = NULL;
+		block->size = (size > ARENA_BLOCKSIZE) ? size : ARENA_BLOCKSIZE;
+		block->used = 0;
+		if (arena->curr == NULL) {
+			arena->head = block;
+		} else {
+			block->next = arena->curr->next;
+			arena->curr->next = block;
+		}
+		arena->curr = block;
+	}
+	p = arena->curr->data + arena->curr->used;
+	arena->curr->used += size;
+	return p;
+}
+
+char *
+arenastrdup(struct Arena *arena, const char *s)
+{
+	size_t size;
+
+	size = strlen(s) + 1;
+	return memcpy(arenaalloc(arena, size), s, size);
+}
+
+void
+arenareset(struct Arena *arena)
+{
+	arena->curr = arena->head;
+	if (arena->curr != NULL) {
+		arena->curr->used = 0;
+	}
+}
+
+size_t
+arenasize(struct Arena *arena)
+{
+	struct ArenaBlock *block;
+	size_t size;
+
+	size = 0;
+	for (block = arena->head; block != NULL; block = block->next)
+		size += sizeof(*block) + block->size;
+	return size;
+}
+
+void
+arenafree(struct Arena *arena)
+{
+	struct ArenaBlock *block;
+
+	while (arena->head != NULL) {
+		block = arena->head;
+		arena->head = block->next;
+		free(block);
+	}
+	arena->curr = NULL;
+}
@@ -1,6 +1,5 @@
 #include <sys/types.h>
 
-#include <dirent.h>
 #include <pthread.h>
 #include <unistd.h>
 
@@ -9,12 +8,16 @@
 #define RETURN_FAILURE  (-1)
 #define RETURN_SUCCESS  0
 
+struct Arena {
+	struct ArenaBlock *head;
+	struct ArenaBlock *curr;
+};
+
 pid_t efork(void);
 int max(int x, int y);
 int min(int x, int y);
 int diff(int x, int y);
 int between(int x, int y, int x0, int y0, int w0, int h0);
-int escandir(const char *dirname, struct dirent ***namelist, int (*select)(const struct dirent *), int (*compar)(const struct dirent **, const struct dirent **));
 void *emalloc(size_t size);
 void *ecalloc(size_t nmemb, size_t size);
 char *estrdup(const char *s);
@@ -23,7 +26,17 @@ void egetcwd(char *path, size_t size);
 void eexec(char *const argv[]);
 void etcreate(pthread_t *tid, void *(*thrfn)(void *), void *arg);
 void etjoin(pthread_t tid, void **rval);
+void etdetach(pthread_t tid);
 void etlock(pthread_mutex_t *mutex);
 void etunlock(pthread_mutex_t *mutex);
+void etwait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+void etsignal(pthread_cond_t *cond);
 int ewaitpid(pid_t pid);
 void eclose(int fd);
+const char *username(uid_t uid);
+const char *groupname(gid_t gid);
+char *arenaalloc(struct Arena *arena, size_t size);
+char *arenastrdup(struct Arena *arena, const char *s);
+void arenareset(struct Arena *arena);
+size_t arenasize(struct Arena *arena);
+void arenafree(struct Arena *arena);
@@ -11,9 +11,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xresource.h>
@@ -23,6 +30,7 @@
 #include <X11/xpm.h>
 #include <X11/Xcursor/Xcursor.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/XShm.h>
 #include <X11/extensions/shape.h>
 
 #include <control/selection.h>
@@ -49,7 +57,8 @@
 	X(_XEMBED, NULL)                        \
 	X(_CONTROL_STATUS, NULL)                \
 	X(_CONTROL_CWD, NULL)                   \
-	X(_CONTROL_GOTO, NULL)
+	X(_CONTROL_GOTO, NULL)                  \
+	X(_WIDGET_WAKEUP, NULL)
 
 #define RESOURCES                                             \
 	/*            CLASS               NAME             */ \
@@ -63,10 +72,19 @@
 	X(SELECT_FG, "ActiveForeground", "activeForeground")  \
 	X(STATUSBAR, "StatusBarEnable",  "statusBarEnable")   \
 	X(BARSTATUS, "EnableStatusBar",  "enableStatusBar")   \
-	X(OPACITY,   "Opacity",          "opacity")
+	X(OPACITY,   "Opacity",          "opacity")           \
+	X(THUMBMEM,  "ThumbnailMemory",  "thumbnailMemory")
 
 #define STATUSBAR_HEIGHT(w) ((w)->fonth * 2)
 #define STATUSBAR_MARGIN(w) ((w)->fonth / 2)
+#define STATUS_BUFSIZE      1024
+#define UNIT_LAST           7
+#define PPM_SPACE           " \t\n\v\f\r"         /* whitespace in PPM headers */
+#define PPM_MAXVAL          65535               /* largest number in PPM headers */
+#define PPM_MAXSIZE         (64 * 1024)         /* largest thumbnail file we read */
+#define THUMBTABSIZE        1024                /* buckets of the table of thumbnails */
+#define DEF_THUMBMEM        32                  /* megabytes of thumbnails kept from other directories */
+#define SHM_SLOTS           16                  /* thumbnails being uploaded through MIT-SHM at once */
 
 enum {
 	XEMBED_EMBEDDED_NOTIFY,
@@ -115,6 +133,10 @@ enum {
 	HANDLE_MAX_SIZE = (SCROLLER_SIZE - 4),  /* max size of the scroller handle */
 };
 
+enum color_depths {
+	DATA_DEPTH = 4,		/* BGRA */
+};
+
 enum {
 	SELECT_NOT,
 	SELECT_YES,
@@ -156,9 +178,15 @@ struct Icon {
 };
 
 struct Thumb {
-	struct Thumb *next;
+	struct Thumb *prev, *next;      /* in the list of shown or of kept thumbnails */
+	struct Thumb *hnext;            /* in the bucket of its path */
+	char *path;                     /* thumbnail file; NULL if not in the table */
+	struct timespec mtime;          /* modification time of the file when loaded */
+	off_t size;                     /* size of the file when loaded */
+	Bool kept;                      /* whether in the list of kept thumbnails */
 	int w, h;
-	XImage *img;
+	Pixmap pix;
+	Picture pict;
 };
 
 struct Selection {
@@ -197,6 +225,8 @@ struct Widget {
 	const char **cliresources;
 
 	char *gototext;
+	Bool wakeup;                    /* whether widget_wakeup() has been called */
+	Bool moved;                     /* whether the user has pressed anything since widget_set() */
 	char ksymbuf[64];               /* buffer where the keysym passed to xfilesctl is held */
 
 	struct {
@@ -220,12 +250,25 @@ struct Widget {
 	pthread_mutex_t lock;
 
 	/*
-	 * Items to be displayed
+	 * Items to be displayed, and the directory they are in.
 	 */
+	char *cwd;
 	Item *items;
 	int nitems;                     /* number of items */
-	int *linelen;                   /* for each item, the lengths of its largest label line */
-	int *nlines;                    /* for each item, the number of label lines */
+
+	/*
+	 * The sizes of the labels are only needed for the items on the
+	 * screen (to know whether the pointer is over a label), so we
+	 * keep them for those alone, rather than for each item.  The
+	 * item at index i keeps its label size at slot i % nlabels,
+	 * which is unique among the nrows * ncols items on the screen.
+	 */
+	struct Label {
+		int index;              /* item this slot was drawn for, or -1 */
+		int len;                /* length of the largest label line */
+		int nlines;             /* number of label lines */
+	} *labels;
+	int nlabels;
 
 	/*
 	 * Items can be selected with the mouse and the Control and Shift modifiers.
@@ -235,27 +278,71 @@ struct Widget {
 	 * doubly-linked list for easily adding and removing any
 	 * element.
 	 *
-	 * We also maintain an array of pointers to selections, so we
-	 * can easily access a selection in the list, and remove it for
-	 * example, given the index of an item.
+	 * The selection of an item is pointed to by its entry in the
+	 * array of item states (see below), so we can easily access a
+	 * selection in the list, and remove it for example, given the
+	 * index of an item.
 	 */
 	struct Selection *sel;          /* list of selections */
 	struct Selection *rectsel;      /* list of selections by rectsel */
-	struct Selection **issel;       /* array of pointers to Selections */
 	Time seltime;
 
 	/*
 	 * We keep track of thumbnails in a list of thumbnails, which is
-	 * essentially a singly-linked list of XImages.  It's kept as a
-	 * singly-linked list just so we can traverse them one-by-one at
-	 * the end for freeing them.
+	 * essentially a singly-linked list of server-side pictures.
+	 * Each thumbnail is uploaded once, when loaded, and composited
+	 * from the server afterwards; so redrawing it sends no pixels.
+	 * It's kept as a singly-linked list just so we can traverse
+	 * them one-by-one when leaving the directory.
 	 *
-	 * We also maintain an array of pointers to thumbnails, so we
-	 * can easily access a thumbnail in the list, given the index
-	 * of an item.
+	 * The thumbnail of an item is pointed to by its entry in the
+	 * array of item states (see below).
+	 *
+	 * When leaving a directory, its thumbnails are not freed, but
+	 * moved into a doubly-linked list of kept thumbnails, the most
+	 * recently used first.  Thumbnails are also indexed by the path
+	 * of their file, so a thumbnail whose file has not changed since
+	 * is reused rather than loaded again when we come back.  Kept
+	 * thumbnails used least recently are freed once all thumbnails
+	 * take more than thumbbudget bytes.  The thumbnails being shown
+	 * are never freed, for their items would lose them.
 	 */
 	struct Thumb *thumbhead;
-	struct Thumb **thumbs;
+	struct Thumb *thumbkept, *thumbtail;
+	struct Thumb *thumbtab[THUMBTABSIZE];
+	size_t thumbbytes;              /* size of all thumbnails, in bytes */
+	size_t thumbbudget;             /* size above which kept thumbnails are freed */
+
+	/*
+	 * When the server supports MIT-SHM and shares memory with us,
+	 * thumbnails are uploaded through a shared segment, cut into
+	 * staging images big enough for the largest thumbnail, instead
+	 * of being written into the connection.  A staging image is busy
+	 * from its upload until the server, with a completion event,
+	 * tells it is done reading it.  The thumbnail threads cannot wait
+	 * for that event, which is read by the main thread; so when all
+	 * staging images are busy, a thumbnail is written into the
+	 * connection instead.
+	 */
+	struct {
+		XShmSegmentInfo info;
+		XImage *img[SHM_SLOTS]; /* staging images, or NULL */
+		Bool busy[SHM_SLOTS];   /* whether the server may be reading each one */
+		int completion;         /* type of the completion event */
+	} shm;
+
+	/*
+	 * The state of each item, indexed as the items are.  Drawing
+	 * an item, or selecting items in a rectangle, looks up both the
+	 * selection and the thumbnail of each item on the screen; so
+	 * they are kept together, rather than in an array each.  The
+	 * array is only allocated when the first item is selected or
+	 * the first thumbnail is loaded.
+	 */
+	struct ItemState {
+		struct Selection *sel;  /* selection of the item, or NULL */
+		struct Thumb *thumb;    /* thumbnail of the item, or NULL */
+	} *states;
 
 	/*
 	 * Geometry of the window and its contents.
@@ -295,8 +382,21 @@ struct Widget {
 	/*
 	 * Index of highlighted item (usually the last item clicked by
 	 * the user); or -1 if none.
+	 *
+	 * The controller can be told about the highlight moving, to
+	 * guess what the user is going to do next.
 	 */
 	int highlight;
+	void (*highlightfn)(void *, int);
+	void *highlightarg;
+
+	/*
+	 * The controller can also be told about the items on the screen
+	 * changing, to do first what the user is looking at.
+	 */
+	void (*scrollfn)(void *, int, int);
+	void *scrollarg;
+	int scrollfirst, scrolllast;    /* items the controller was last told about */
 
 	/*
 	 * The scroller how this code calls the widget that replaces the
@@ -316,8 +416,12 @@ struct Widget {
 
 	/*
 	 * Statusbar describing highlighted item.
+	 *
+	 * The status of an item is only formatted when it is displayed,
+	 * from the metadata retained in the item.
 	 */
 	Bool status_enable;
+	char statusbuf[STATUS_BUFSIZE];
 };
 
 struct Options {
@@ -332,6 +436,19 @@ static Atom atoms[NATOMS];
 /* ellipsis has two dots rather than three; the third comes from the extension */
 static char const *ELLIPSIS = "..";
 
+static struct {
+	char u;
+	long long int n;
+} units[UNIT_LAST] = {
+	{ 'B', 1LL },
+	{ 'K', 1024LL },
+	{ 'M', 1024LL * 1024 },
+	{ 'G', 1024LL * 1024 * 1024 },
+	{ 'T', 1024LL * 1024 * 1024 * 1024 },
+	{ 'P', 1024LL * 1024 * 1024 * 1024 * 1024 },
+	{ 'E', 1024LL * 1024 * 1024 * 1024 * 1024 * 1024 },
+};
+
 static int
 error_handler(Display *display, XErrorEvent *error)
 {
@@ -349,15 +466,103 @@ error_handler(Display *display, XErrorEvent *error)
 	return 0; /* unreachable */
 }
 
+static Bool shmfailed = False;
+
+static int
+shmerror(Display *display, XErrorEvent *error)
+{
+	(void)display;
+	(void)error;
+	shmfailed = True;
+	return 0;
+}
+
 static char const *
 getitemstatus(Widget *widget, int index)
 {
 	static char const *UNKNOWN_STATUS = "<\?\?\?>";
+	Item *item;
+	int i;
+	long long int number, fract;
+	struct tm tm;
+	char const *user, *group;
+	char const *sep = "";
+	char timebuf[128];
+
 	if (index < 0 || index >= widget->nitems)
 		return UNKNOWN_STATUS;
-	if (widget->items[widget->highlight].status == NULL)
-		return UNKNOWN_STATUS;
-	return widget->items[widget->highlight].status;
+	item = &widget->items[index];
+	if ((item->mode & MODE_MASK) == MODE_ANY)
+		return UNKNOWN_STATUS;      /* could not stat(2) item */
+	number = 0;
+	if (item->size <= 0)
+		goto done;
+	for (i = 0; i < UNIT_LAST; i++)
+		if (item->size < units[i + 1].n)
+			break;
+	if (i == UNIT_LAST)
+		goto done;
+	fract = (i == 0) ? 0 : item->size % units[i].n;
+	fract /= (i == 0) ? 1 : units[i - 1].n;
+	fract = (10 * fract + 512) / 1024;
+	number = item->size / units[i].n;
+	if (number <= 0)
+		goto done;
+	if (fract >= 10 || (fract >= 5 && number >= 100)) {
+		number++;
+		fract = 0;
+	} else if (fract < 0) {
+		fract = 0;
+	}
+done:
+	if ((group = groupname(item->gid)) == NULL)
+		group = "";
+	if ((user = username(item->uid)) == NULL) {
+		user = "?";
+	} else if (strcmp(user, group) == 0) {
+		group = "";
+	} else {
+		sep = ":";
+	}
+	(void)localtime_r(&item->mtime, &tm);
+	(void)strftime(timebuf, sizeof(timebuf), "%F %R", &tm);
+	if (number <= 0) {
+		(void)snprintf(
+			widget->statusbuf,
+			sizeof(widget->statusbuf),
+			"0B - %s%s%s - %s",
+			user,
+			sep,
+			group,
+			timebuf
+		);
+	} else if (number >= 100) {
+		(void)snprintf(
+			widget->statusbuf,
+			sizeof(widget->statusbuf),
+			"%lld%c - %s%s%s - %s",
+			number,
+			units[i].u,
+			user,
+			sep,
+			group,
+			timebuf
+		);
+	} else {
+		(void)snprintf(
+			widget->statusbuf,
+			sizeof(widget->statusbuf),
+			"%lld.%lld%c - %s%s%s - %s",
+			number,
+			fract,
+			units[i].u,
+			user,
+			sep,
+			group,
+			timebuf
+		);
+	}
+	return widget->statusbuf;
 }
 
 static void
@@ -536,7 +741,7 @@ drawstatusbar(Widget *widget)
 		LEN(countstr),
 		"[%d/%d]",
 		widget->highlight > 0 ? widget->highlight : 0,
-		widget->nitems - 1      /* -1 because the first item ".." is not counted */
+		max(widget->nitems - 1, 0)      /* -1 because the first item ".." is not counted */
 	);
 	countwid = ctrlfnt_draw(
 		widget->fontset,
@@ -641,6 +846,7 @@ loadresources(Widget *widget, const char *str)
 	char *endp;
 	char *fontname = NULL;
 	double d;
+	long l;
 	double fontsize = 0.0;
 	Bool changefont = False;
 
@@ -685,6 +891,12 @@ loadresources(Widget *widget, const char *str)
 		case OPACITY:
 			setopacity(widget, value);
 			break;
+		case THUMBMEM:
+			l = strtol(value, &endp, 10);
+			if (value[0] != '\0' && *endp == '\0' && l >= 0 &&
+			    (unsigned long)l <= SIZE_MAX / 1024 / 1024)
+				widget->thumbbudget = (size_t)l * 1024 * 1024;
+			break;
 		case STATUSBAR:
 		case BARSTATUS:
 			widget->status_enable =  strcasecmp(value, "on") == 0
@@ -731,6 +943,42 @@ embed_resize(Widget *widget)
 	XSync(widget->display, False);
 }
 
+static struct Selection *
+getselection(Widget *widget, int index)
+{
+	if (widget->states == NULL)
+		return NULL;
+	return widget->states[index].sel;
+}
+
+static struct Thumb *
+getthumb(Widget *widget, int index)
+{
+	if (widget->states == NULL)
+		return NULL;
+	return widget->states[index].thumb;
+}
+
+static void
+resetlabels(Widget *widget, int nlabels)
+{
+	struct Label *labels;
+	int i;
+
+	if (nlabels != widget->nlabels) {
+		labels = realloc(widget->labels, nlabels * sizeof(*labels));
+		if (labels == NULL) {
+			warn("realloc");
+			free(widget->labels);
+			nlabels = 0;
+		}
+		widget->labels = labels;
+		widget->nlabels = nlabels;
+	}
+	for (i = 0; i < widget->nlabels; i++)
+		widget->labels[i].index = -1;
+}
+
 static int
 calcsize(Widget *widget, int w, int h)
 {
@@ -775,6 +1023,7 @@ calcsize(Widget *widget, int w, int h)
 		widget->pixh = widget->nrows * widget->itemh;
 		resetlayer(widget, LAYER_ICONS, widget->pixw, widget->pixh);
 		resetlayer(widget, LAYER_SELALPHA, widget->pixw, widget->pixh);
+		resetlabels(widget, widget->ncols * widget->nrows);
 		ret = True;
 	}
 	resetlayer(widget, LAYER_RECTALPHA, widget->w, widget->h);
@@ -834,24 +1083,27 @@ static void
 drawicon(Widget *widget, int index, int x, int y)
 {
 	struct Icon *icon;
+	struct Thumb *thumb;
 	Pixmap pix, mask;
 	int xorigin;
 
 	icon = geticon(widget, index);
 	pix = icon->pix;
 	mask = icon->mask;
-	if (widget->thumbs != NULL && widget->thumbs[index] != NULL) {
+	if ((thumb = getthumb(widget, index)) != NULL) {
 		/* draw thumbnail */
-		XPutImage(
+		XRenderComposite(
 			widget->display,
-			widget->layers[LAYER_ICONS].pix,
-			widget->gc,
-			widget->thumbs[index]->img,
+			PictOpSrc,
+			thumb->pict,
+			None,
+			widget->layers[LAYER_ICONS].pict,
+			0, 0,
 			0, 0,
-			x + (widget->itemw - widget->thumbs[index]->w) / 2,
-			y + (THUMBSIZE - widget->thumbs[index]->h) / 2,
-			widget->thumbs[index]->w,
-			widget->thumbs[index]->h
+			x + (widget->itemw - thumb->w) / 2,
+			y + (THUMBSIZE - thumb->h) / 2,
+			thumb->w,
+			thumb->h
 		);
 	} else {
 		/* draw icon */
@@ -887,6 +1139,8 @@ drawicon(Widget *widget, int index, int x, int y)
 static void
 drawlabel(Widget *widget, int index, int x, int y)
 {
+	struct Label scratch;
+	struct Label *label;
 	Picture color;
 	int i, sel;
 	int textx, maxw;
@@ -894,26 +1148,30 @@ drawlabel(Widget *widget, int index, int x, int y)
 	int extensionw, extensionlen;
 	char *text, *extension;
 
-	if (widget->issel != NULL && widget->issel[index])
+	if (getselection(widget, index) != NULL)
 		sel = SELECT_YES;
 	else
 		sel = SELECT_NOT;
 	color = widget->colors[sel][COLOR_FG].pict;
 	text = widget->items[index].name;
-	widget->nlines[index] = 1;
+	label = &scratch;
+	if (widget->nlabels > 0)
+		label = &widget->labels[index % widget->nlabels];
+	label->index = index;
+	label->nlines = 1;
 	textx = x + widget->itemw / 2 - LABELWIDTH / 2;
 	extension = NULL;
 	textw = 0;
 	maxw = 0;
 	textlen = 0;
-	widget->linelen[index] = 0;
-	for (i = 0; i < widget->nlines[index]; i++) {
+	label->len = 0;
+	for (i = 0; i < label->nlines; i++) {
 		while (isspace(text[textlen]))
 			textlen++;
 		text += textlen;
 		textlen = strlen(text);
 		textw = ctrlfnt_width(widget->fontset, text, textlen);
-		if (widget->nlines[index] < NLINES && textw >= LABELWIDTH) {
+		if (label->nlines < NLINES && textw >= LABELWIDTH) {
 			textlen = len = 0;
 			w = 0;
 			while (w < LABELWIDTH) {
@@ -931,7 +1189,7 @@ drawlabel(Widget *widget, int index, int x, int y)
 				}
 			}
 			if (textw > 0) {
-				widget->nlines[index] = min(widget->nlines[index] + 1, NLINES);
+				label->nlines = min(label->nlines + 1, NLINES);
 			} else {
 				textlen = len;
 				textw = w;
@@ -946,7 +1204,7 @@ drawlabel(Widget *widget, int index, int x, int y)
 			text, textlen
 		);
 		textw = min(textw, LABELWIDTH);
-		widget->linelen[index] = max(widget->linelen[index], textw);
+		label->len = max(label->len, textw);
 		XCopyArea(
 			widget->display,
 			widget->namepix, widget->layers[LAYER_ICONS].pix,
@@ -974,7 +1232,7 @@ drawlabel(Widget *widget, int index, int x, int y)
 			0, 0,
 			widget->ellipsisw, widget->fonth,
 			textx + textw - extensionw - widget->ellipsisw,
-			y + widget->itemh - (NLINES + 1 - widget->nlines[index] + 0.5) * widget->fonth
+			y + widget->itemh - (NLINES + 1 - label->nlines + 0.5) * widget->fonth
 		);
 
 		/* draw extension */
@@ -986,7 +1244,7 @@ drawlabel(Widget *widget, int index, int x, int y)
 			0, 0,
 			extensionw, widget->fonth,
 			textx + textw - extensionw,
-			y + widget->itemh - (NLINES + 1 - widget->nlines[index] + 0.5) * widget->fonth
+			y + widget->itemh - (NLINES + 1 - label->nlines + 0.5) * widget->fonth
 		);
 	}
 	if (index == widget->highlight) {
@@ -1000,7 +1258,7 @@ drawlabel(Widget *widget, int index, int x, int y)
 			maxw + 2, 1
 		);
 	}
-	if (widget->issel != NULL && widget->issel[index]) {
+	if (sel == SELECT_YES) {
 		XRenderFillRectangle(
 			widget->display,
 			PictOpOverReverse,
@@ -1062,7 +1320,7 @@ drawitem(Widget *widget, int index)
 	drawlabel(widget, index, x, y);
 	XRenderFillRectangle(
 		widget->display,
-		widget->issel[index] ? PictOpSrc : PictOpClear,
+		getselection(widget, index) != NULL ? PictOpSrc : PictOpClear,
 		widget->layers[LAYER_SELALPHA].pict,
 		&(XRenderColor){
 			.red   = 0xFFFF,
@@ -1104,6 +1362,12 @@ drawitems(Widget *widget)
 	for (i = widget->row * widget->ncols; i <= n; i++) {
 		drawitem(widget, i);
 	}
+	if (widget->scrollfn != NULL &&
+	    (widget->scrollfirst != firstvisible(widget) || widget->scrolllast != n)) {
+		widget->scrollfirst = firstvisible(widget);
+		widget->scrolllast = n;
+		widget->scrollfn(widget->scrollarg, widget->scrollfirst, n);
+	}
 }
 
 static void
@@ -1328,24 +1592,238 @@ scroll(Widget *widget, int y)
 }
 
 static int
-readsize(FILE *fp)
+ppmfield(unsigned char *buf, size_t len, size_t *pos)
 {
-	int size, c, n, i;
+	int n;
 
-	size = 0;
-	for (i = 0; i < 3; i++) {
-		c = fgetc(fp);
-		if (c == EOF)
+	/*
+	 * Read a number from the header of a PPM file, after any
+	 * whitespace and comments (from '#' to the end of the line).
+	 */
+	for (;;) {
+		if (*pos >= len)
 			return -1;
-		if (c < '0' || c > '9')
+		if (buf[*pos] == '#')
+			while (*pos < len && buf[*pos] != '\n' && buf[*pos] != '\r')
+				(*pos)++;
+		else if (buf[*pos] != '\0' && strchr(PPM_SPACE, buf[*pos]) != NULL)
+			(*pos)++;
+		else
 			break;
-		n = c - '0';
-		size *= 10;
-		size += n;
 	}
-	if (i == 0 || (i == 3 && c >= '0' && c <= '9'))
+	if (buf[*pos] < '0' || buf[*pos] > '9')
 		return -1;
-	return size;
+	for (n = 0; *pos < len && buf[*pos] >= '0' && buf[*pos] <= '9'; (*pos)++) {
+		n = n * 10 + buf[*pos] - '0';
+		if (n > PPM_MAXVAL)
+			return -1;
+	}
+	return n;
+}
+
+static void
+rgbtobgra(unsigned char *dst, unsigned char *src, size_t npixels)
+{
+	size_t i;
+#ifdef __SSSE3__
+	__m128i shuffle, alpha;
+#endif
+
+	i = 0;
+#ifdef __SSSE3__
+	/*
+	 * Four pixels at a time: load 16 bytes (of which the last four
+	 * belong to the next pixels), swap R and B of each pixel into
+	 * its own 32-bit slot, and set the alpha bytes.
+	 */
+	shuffle = _mm_setr_epi8(
+		2, 1, 0, -1, 5, 4, 3, -1,
+		8, 7, 6, -1, 11, 10, 9, -1
+	);
+	alpha = _mm_set1_epi32((int)0xFF000000);
+	for (; npixels - i >= 6; i += 4) {
+		_mm_storeu_si128(
+			(__m128i *)(dst + i * 4),
+			_mm_or_si128(
+				_mm_shuffle_epi8(
+					_mm_loadu_si128((__m128i *)(src + i * 3)),
+					shuffle
+				),
+				alpha
+			)
+		);
+	}
+#endif
+	for (; i < npixels; i++) {
+		dst[i * 4 + 0] = src[i * 3 + 2];        /* B */
+		dst[i * 4 + 1] = src[i * 3 + 1];        /* G */
+		dst[i * 4 + 2] = src[i * 3 + 0];        /* R */
+		dst[i * 4 + 3] = 0xFF;                  /* A */
+	}
+}
+
+static unsigned char *
+loadppm(const char *path, int *wp, int *hp)
+{
+	struct stat sb;
+	size_t len, pos, size, depth, i, j;
+	ssize_t n;
+	unsigned int v;
+	int fd, w, h, maxval;
+	unsigned char *buf, *data;
+
+	/*
+	 * Read a PPM file (a thumbnail) into BGRA pixels, as XImages
+	 * want them.  Thumbnails are small, so the whole file is read
+	 * at once, then parsed in memory.
+	 */
+	buf = NULL;
+	data = NULL;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) == -1) {
+		warn("%s", path);
+		goto error;
+	}
+	if (sb.st_size < 0 || sb.st_size > PPM_MAXSIZE) {
+		warnx("%s: ppm file too large", path);
+		goto error;
+	}
+	len = sb.st_size;
+	if ((buf = malloc(len + 1)) == NULL) {
+		warn("malloc");
+		goto error;
+	}
+	for (pos = 0; pos < len; pos += n) {
+		if ((n = read(fd, buf + pos, len - pos)) == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n == -1) {
+			warn("%s", path);
+			goto error;
+		} else if (n == 0) {
+			break;
+		}
+	}
+	len = pos;
+	buf[len] = '\0';
+	pos = 2;
+	if (len < 2 || buf[0] != 'P' || buf[1] != '6') {
+		warnx("%s: not a ppm file", path);
+		goto error;
+	}
+	if ((w = ppmfield(buf, len, &pos)) <= 0 ||
+	    (h = ppmfield(buf, len, &pos)) <= 0 ||
+	    (maxval = ppmfield(buf, len, &pos)) <= 0 ||
+	    pos >= len || strchr(PPM_SPACE, buf[pos]) == NULL || buf[pos] == '\0') {
+		warnx("%s: ppm file with invalid header", path);
+		goto error;
+	}
+	pos++;                  /* a single whitespace ends the header */
+	if (w > THUMBSIZE || h > THUMBSIZE) {
+		warnx("%s: ppm file too large: %dx%d", path, w, h);
+		goto error;
+	}
+	size = (size_t)w * h;
+	depth = (maxval > UCHAR_MAX) ? 2 : 1;
+	if (len - pos < size * 3 * depth) {
+		warnx("%s: ppm file too short", path);
+		goto error;
+	}
+	if ((data = malloc(size * 4)) == NULL) {
+		warn("malloc");
+		goto error;
+	}
+	if (maxval == UCHAR_MAX) {
+		rgbtobgra(data, buf + pos, size);
+	} else {
+		/* scale samples other than 8-bit ones into 0-255 */
+		for (i = 0; i < size; i++) {
+			for (j = 0; j < 3; j++) {
+				v = buf[pos + (i * 3 + j) * depth];
+				if (depth == 2)
+					v = v << 8 | buf[pos + (i * 3 + j) * 2 + 1];
+				v = min(v, maxval);
+				data[i * 4 + 2 - j] = (v * UCHAR_MAX + maxval / 2) / maxval;
+			}
+			data[i * 4 + 3] = 0xFF;
+		}
+	}
+	free(buf);
+	(void)close(fd);
+	*wp = w;
+	*hp = h;
+	return data;
+error:
+	free(buf);
+	free(data);
+	(void)close(fd);
+	return NULL;
+}
+
+static int
+putthumb(Widget *widget, Pixmap pix, unsigned char *data, int w, int h)
+{
+	XImage *img;
+	int i, y;
+
+	img = NULL;
+	if (widget->shm.img[0] != NULL) {
+		etlock(&widget->lock);
+		for (i = 0; i < SHM_SLOTS; i++) {
+			if (!widget->shm.busy[i]) {
+				widget->shm.busy[i] = True;
+				img = widget->shm.img[i];
+				break;
+			}
+		}
+		etunlock(&widget->lock);
+	}
+	if (img != NULL) {
+		for (y = 0; y < h; y++) {
+			memcpy(
+				img->data + y * img->bytes_per_line,
+				data + y * w * DATA_DEPTH,
+				w * DATA_DEPTH
+			);
+		}
+
+		/*
+		 * Ask for a completion event, for the staging image to be
+		 * freed when the server is done reading it; and flush, for
+		 * that not to wait for the main thread to flush.
+		 */
+		(void)XShmPutImage(
+			widget->display, pix,
+			widget->gc, img,
+			0, 0, 0, 0, w, h,
+			True
+		);
+		XFlush(widget->display);
+		return RETURN_SUCCESS;
+	}
+	img = XCreateImage(
+		widget->display,
+		widget->visual,
+		widget->depth,
+		ZPixmap,
+		0, (char *)data,
+		w, h,
+		DATA_DEPTH * CHAR_BIT,
+		0
+	);
+	if (img == NULL)
+		return RETURN_FAILURE;
+	XInitImage(img);
+	(void)XPutImage(
+		widget->display, pix,
+		widget->gc, img,
+		0, 0, 0, 0, w, h
+	);
+	img->data = NULL;       /* the pixels are the caller's */
+	XDestroyImage(img);
+	return RETURN_SUCCESS;
 }
 
 static int
@@ -1374,6 +1852,7 @@ getitem(Widget *widget, int row, int ydiff, int *x, int *y)
 static int
 getitemundercursor(Widget *widget, int x, int y)
 {
+	struct Label *label;
 	int iconx, textx, texty, i;
 
 	if ((i = getitem(widget, widget->row, widget->ydiff, &x, &y)) < 0)
@@ -1383,12 +1862,15 @@ getitemundercursor(Widget *widget, int x, int y)
 	iconx = (widget->itemw - THUMBSIZE) / 2;
 	if (x >= iconx && x < iconx + THUMBSIZE && y >= 0 && y < THUMBSIZE + widget->fonth / 2)
 		return i;
-	if (widget->linelen == NULL)
+	if (widget->nlabels == 0)
+		return -1;
+	label = &widget->labels[i % widget->nlabels];
+	if (label->index != i)
 		return -1;
-	textx = (widget->itemw - widget->linelen[i]) / 2;
+	textx = (widget->itemw - label->len) / 2;
 	texty = widget->itemh - (NLINES + 0.5) * widget->fonth;
-	if (x >= textx && x < textx + widget->linelen[i] &&
-	    y >= texty && y < texty + widget->nlines[i] * widget->fonth) {
+	if (x >= textx && x < textx + label->len &&
+	    y >= texty && y < texty + label->nlines * widget->fonth) {
 		return i;
 	}
 	return -1;
@@ -1439,7 +1921,13 @@ fillclipboard(Widget *widget, unsigned char **bufp, Bool uriformat)
 		delim = "";
 	}
 	for (sel = widget->sel; sel != NULL; sel = sel->next) {
-		char *name = widget->items[sel->index].fullname;
+		char name[PATH_MAX];
+
+		(void)snprintf(
+			name, sizeof(name), "%s/%s",
+			strcmp(widget->cwd, "/") == 0 ? "" : widget->cwd,
+			widget->items[sel->index].name
+		);
 
 		if (!uriformat)
 			(void)fprintf(clip->stream, "%s%s", name, delim);
@@ -1504,22 +1992,106 @@ resetclipboard(Widget *widget)
 	widget->plainclip.filled = widget->uriclip.filled = False;
 }
 
+static struct Thumb **
+thumbbucket(Widget *widget, const char *path)
+{
+	unsigned long h;
+
+	/* FNV-1a */
+	for (h = 2166136261UL; *path != '\0'; path++)
+		h = ((h ^ (unsigned char)*path) * 16777619UL) & 0xFFFFFFFFUL;
+	return &widget->thumbtab[h % THUMBTABSIZE];
+}
+
 static void
-cleanwidget(Widget *widget)
+unhashthumb(Widget *widget, struct Thumb *thumb)
+{
+	struct Thumb **p;
+
+	if (thumb->path == NULL)
+		return;
+	for (p = thumbbucket(widget, thumb->path); *p != NULL; p = &(*p)->hnext) {
+		if (*p == thumb) {
+			*p = thumb->hnext;
+			break;
+		}
+	}
+	thumb->hnext = NULL;
+	free(thumb->path);
+	thumb->path = NULL;
+}
+
+static void
+unkeepthumb(Widget *widget, struct Thumb *thumb)
+{
+	if (thumb->prev != NULL)
+		thumb->prev->next = thumb->next;
+	else
+		widget->thumbkept = thumb->next;
+	if (thumb->next != NULL)
+		thumb->next->prev = thumb->prev;
+	else
+		widget->thumbtail = thumb->prev;
+	thumb->prev = thumb->next = NULL;
+	thumb->kept = False;
+}
+
+static void
+freethumb(Widget *widget, struct Thumb *thumb)
+{
+	unhashthumb(widget, thumb);
+	widget->thumbbytes -= (size_t)thumb->w * thumb->h * DATA_DEPTH;
+	XRenderFreePicture(widget->display, thumb->pict);
+	XFreePixmap(widget->display, thumb->pix);
+	free(thumb);
+}
+
+static void
+trimthumbs(Widget *widget)
 {
 	struct Thumb *thumb;
+
+	while (widget->thumbbytes > widget->thumbbudget &&
+	       (thumb = widget->thumbtail) != NULL) {
+		unkeepthumb(widget, thumb);
+		freethumb(widget, thumb);
+	}
+}
+
+static void
+keepthumbs(Widget *widget)
+{
+	struct Thumb *thumb, *next;
+
+	for (thumb = widget->thumbhead; thumb != NULL; thumb = next) {
+		next = thumb->next;
+		if (thumb->path == NULL) {
+			/* its file changed or could not be stat(2)ed */
+			freethumb(widget, thumb);
+			continue;
+		}
+		thumb->prev = NULL;
+		thumb->next = widget->thumbkept;
+		thumb->kept = True;
+		if (widget->thumbkept != NULL)
+			widget->thumbkept->prev = thumb;
+		else
+			widget->thumbtail = thumb;
+		widget->thumbkept = thumb;
+	}
+	widget->thumbhead = NULL;
+	trimthumbs(widget);
+}
+
+static void
+cleanwidget(Widget *widget)
+{
 	struct Selection *sel;
 
 	if (!widget->isset)
 		return;
 	resetclipboard(widget);
-	thumb = widget->thumbhead;
-	while (thumb != NULL) {
-		struct Thumb *tmp = thumb;
-		thumb = thumb->next;
-		XDestroyImage(tmp->img);
-		free(tmp);
-	}
+	keepthumbs(widget);
 	sel = widget->sel;
 	while (sel != NULL) {
 		struct Selection *tmp = sel;
@@ -1530,10 +2102,8 @@ cleanwidget(Widget *widget)
 	widget->rectsel = NULL;
 #define FREE(x) (free(x), x = NULL)
 	FREE(widget->gototext);
-	FREE(widget->thumbs);
-	FREE(widget->linelen);
-	FREE(widget->nlines);
-	FREE(widget->issel);
+	FREE(widget->cwd);
+	FREE(widget->states);
 #undef  FREE
 	disownprimary(widget);
 	(void)XChangeProperty(
@@ -1548,6 +2118,30 @@ cleanwidget(Widget *widget)
 	);
 }
 
+static int
+allocstates(Widget *widget)
+{
+	int retval;
+
+	/*
+	 * The first selection (in the main thread) and the first
+	 * thumbnail (in a thumbnailer thread) can come at the same time;
+	 * check again under the lock, for only one of them to allocate.
+	 */
+	if (widget->states != NULL)
+		return RETURN_SUCCESS;
+	retval = RETURN_SUCCESS;
+	etlock(&widget->lock);
+	if (widget->states == NULL)
+		widget->states = calloc(widget->nitems, sizeof(*widget->states));
+	if (widget->states == NULL) {
+		warn("calloc");
+		retval = RETURN_FAILURE;
+	}
+	etunlock(&widget->lock);
+	return retval;
+}
+
 static void
 selectitem(Widget *widget, int index, int select, int rectsel)
 {
@@ -1555,14 +2149,18 @@ selectitem(Widget *widget, int index, int select, int rectsel)
 	struct Selection **header;
 
 	resetclipboard(widget);
-	if (widget->issel == NULL || index <= 0 || index >= widget->nitems)
+	if (index <= 0 || index >= widget->nitems)
+		return;
+	if (widget->states == NULL && !select)
+		return;
+	if (allocstates(widget) == RETURN_FAILURE)
 		return;
 	/*
 	 * We have two lists of selections: the global list (widget->sel),
 	 * and the list used by rectangular selection (widget->rectsel).
 	 */
 	header = rectsel ? &widget->rectsel : &widget->sel;
-	if (select && widget->issel[index] == NULL) {
+	if (select && widget->states[index].sel == NULL) {
 		if ((sel = malloc(sizeof(*sel))) == NULL)
 			return;
 		*sel = (struct Selection){
@@ -1573,9 +2171,9 @@ selectitem(Widget *widget, int index, int select, int rectsel)
 		if (*header != NULL)
 			(*header)->prev = sel;
 		*header = sel;
-		widget->issel[index] = sel;
-	} else if (!select && widget->issel[index] != NULL) {
-		sel = widget->issel[index];
+		widget->states[index].sel = sel;
+	} else if (!select && widget->states[index].sel != NULL) {
+		sel = widget->states[index].sel;
 		if (sel->next != NULL)
 			sel->next->prev = sel->prev;
 		if (sel->prev != NULL)
@@ -1583,7 +2181,7 @@ selectitem(Widget *widget, int index, int select, int rectsel)
 		if (*header == sel)
 			*header = sel->next;
 		free(sel);
-		widget->issel[index] = NULL;
+		widget->states[index].sel = NULL;
 	} else {
 		return;
 	}
@@ -1600,6 +2198,8 @@ highlight(Widget *widget, int index)
 		return;
 	prevhili = widget->highlight;
 	widget->highlight = index;
+	if (widget->highlightfn != NULL)
+		widget->highlightfn(widget->highlightarg, index);
 	if (index != 0)
 		drawitem(widget, index);
 	/* we still have to redraw the previous entry */
@@ -1684,7 +2284,7 @@ mouse1click(Widget *widget, XButtonPressedEvent *ev)
 	int prevhili, index;
 
 	index = getitemundercursor(widget, ev->x, ev->y);
-	if (index > 0 && widget->issel[index] != NULL)
+	if (index > 0 && getselection(widget, index) != NULL)
 		return index;
 	if (!(ev->state & (ControlMask | ShiftMask)))
 		unselectitems(widget);
@@ -1695,7 +2295,7 @@ mouse1click(Widget *widget, XButtonPressedEvent *ev)
 	if (prevhili != -1 && ev->state & ShiftMask)
 		selectitems(widget, widget->highlight, prevhili);
 	else
-		selectitem(widget, widget->highlight, ((ev->state & ControlMask) ? widget->issel[widget->highlight] == NULL : True), False);
+		selectitem(widget, widget->highlight, ((ev->state & ControlMask) ? getselection(widget, widget->highlight) == NULL : True), False);
 	ownprimary(widget, ev->time);
 	return index;
 }
@@ -1708,7 +2308,7 @@ mouse3click(Widget *widget, int x, int y)
 	index = getitemundercursor(widget, x, y);
 	if (index != -1) {
 		highlight(widget, index);
-		if (widget->issel[index] == NULL) {
+		if (getselection(widget, index) == NULL) {
 			unselectitems(widget);
 			selectitem(widget, index, True, False);
 		}
@@ -1794,6 +2394,7 @@ pixelstocolrow(Widget *widget, int visrow, int x, int y, int *col, int *row)
 static Bool
 rectselect(Widget *widget, int srcrow, int srcydiff, int x0, int y0, int x1, int y1)
 {
+	struct Selection *cur;
 	Bool changed = False;
 	Bool sel;
 	int row, col, tmp, i;
@@ -1846,9 +2447,10 @@ rectselect(Widget *widget, int srcrow, int srcydiff, int x0, int y0, int x1, int
 			/* item is on a row at edge of selection */
 			sel = False;
 		}
-		if (!sel && (widget->issel[i] == NULL || widget->issel[i]->index > 0))
+		cur = getselection(widget, i);
+		if (!sel && (cur == NULL || cur->index > 0))
 			continue;
-		if (sel && widget->issel[i] != NULL && widget->issel[i]->index > 0)
+		if (sel && cur != NULL && cur->index > 0)
 			selectitem(widget, i, False, False);
 		selectitem(widget, i, sel, True);
 		changed = True;
@@ -1917,18 +2519,6 @@ scrollerset(Widget *widget, int pos)
 	}
 }
 
-static int
-checkheader(FILE *fp, unsigned char const *header, size_t size)
-{
-	char buf[8];    /* enough for a .PPM header field */
-
-	if (fread(buf, 1, size, fp) != size)
-		return RETURN_FAILURE;
-	if (memcmp(buf, header, size) != 0)
-		return RETURN_FAILURE;
-	return RETURN_SUCCESS;
-}
-
 static int
 pixmapfromdata(Widget *widget, char **data, Pixmap *pix, Pixmap *mask)
 {
@@ -1953,10 +2543,10 @@ fillselitems(Widget *widget, int *selitems)
 	int i, nitems;
 
 	nitems = 0;
-	if (widget->issel == NULL)
+	if (widget->states == NULL)
 		return 0;
 	for (i = 0; i < widget->nitems; i++)
-		if (widget->issel[i] != NULL)
+		if (widget->states[i].sel != NULL)
 			selitems[nitems++] = i;
 	return nitems;
 }
@@ -2083,31 +2673,19 @@ createwindow(Widget *widget, Window parent, XRectangle rect, long eventmask, Boo
 static Window
 create_dragwin(Widget *widget, int index)
 {
-	Pixmap pix, iconbg, iconmask;
+	Pixmap iconbg, iconmask;
 	Window dndicon;
 	struct Icon *icon;
+	struct Thumb *thumb;
 	unsigned int width, height;
 
 	if (index < 1)
 		return None;
-	pix = None;
 	dndicon = None;
-	if (widget->thumbs[index] != NULL) {
-		width = widget->thumbs[index]->w;
-		height = widget->thumbs[index]->h;
-		pix = XCreatePixmap(
-			widget->display, widget->window,
-			width, height, widget->depth
-		);
-		if (pix == None)
-			goto error;
-		(void)XPutImage(
-			widget->display, pix,
-			widget->gc,
-			widget->thumbs[index]->img,
-			0, 0, 0, 0, width, height
-		);
-		iconbg = pix;
+	if ((thumb = getthumb(widget, index)) != NULL) {
+		width = thumb->w;
+		height = thumb->h;
+		iconbg = thumb->pix;
 		iconmask = None;
 	} else if ((icon = geticon(widget, index)) != NULL) {
 		width = THUMBSIZE;
@@ -2131,8 +2709,6 @@ create_dragwin(Widget *widget, int index)
 		0, 0, iconmask, ShapeSet
 	);
 error:
-	if (pix != None)
-		XFreePixmap(widget->display, pix);
 	return dndicon;
 }
 
@@ -2310,7 +2886,7 @@ keypress(Widget *widget, XKeyEvent *xev, int *selitems, int *nitems, char **text
 			selectitem(
 				widget,
 				widget->highlight,
-				widget->issel[widget->highlight] == NULL,
+				getselection(widget, widget->highlight) == NULL,
 				False
 			);
 		}
@@ -2461,6 +3037,22 @@ compress_motion(Display *display, XEvent *event)
 	}
 }
 
+static void
+shmdone(Widget *widget, XShmCompletionEvent *ev)
+{
+	int i;
+
+	/* the server is done reading a staging image; it can be reused */
+	etlock(&widget->lock);
+	for (i = 0; i < SHM_SLOTS; i++) {
+		if ((unsigned long)(widget->shm.img[i]->data - widget->shm.info.shmaddr) == ev->offset) {
+			widget->shm.busy[i] = False;
+			break;
+		}
+	}
+	etunlock(&widget->lock);
+}
+
 static Bool
 filter_event(Widget *widget, XEvent *ev)
 {
@@ -2468,6 +3060,10 @@ filter_event(Widget *widget, XEvent *ev)
 	int newrow;
 
 	widget->redraw = False;
+	if (widget->shm.img[0] != NULL && ev->type == widget->shm.completion) {
+		shmdone(widget, (XShmCompletionEvent *)ev);
+		return True;
+	}
 	switch (ev->type) {
 	case MotionNotify:
 		compress_motion(widget->display, ev);
@@ -2527,6 +3123,10 @@ filter_event(Widget *widget, XEvent *ev)
 	case ClientMessage:
 		if (ev->xclient.window != widget->window)
 			return False;
+		if (ev->xclient.message_type == atoms[_WIDGET_WAKEUP]) {
+			widget->wakeup = True;
+			return False;
+		}
 		if (ev->xclient.message_type != atoms[WM_PROTOCOLS])
 			return False;
 		if ((Atom)ev->xclient.data.l[0] != atoms[WM_DELETE_WINDOW])
@@ -2823,7 +3423,7 @@ dragmode(Widget *widget, Time timestamp, int index, int *selitems, int *nitems)
 	highlight(widget, index);
 	if (index < 1 || index >= widget->nitems)
 		return WIDGET_NONE;
-	if (widget->issel[index] != NULL)
+	if (getselection(widget, index) != NULL)
 		return WIDGET_NONE;     /* dont drop item on itself */
 	/*
 	 * First item is the one where user has dropped.
@@ -2840,6 +3440,20 @@ dragmode(Widget *widget, Time timestamp, int index, int *selitems, int *nitems)
 	}
 }
 
+static WidgetEvent
+takewakeup(Widget *widget)
+{
+	/*
+	 * The other modes have their own event loops, which note the
+	 * wakeup messages but do not return them; return them once
+	 * those modes are done.
+	 */
+	if (!widget->wakeup)
+		return WIDGET_NONE;
+	widget->wakeup = False;
+	return WIDGET_WAKEUP;
+}
+
 static WidgetEvent
 mainmode(Widget *widget, int *selitems, int *nitems, char **text)
 {
@@ -2861,6 +3475,7 @@ mainmode(Widget *widget, int *selitems, int *nitems, char **text)
 		}
 		continue;
 	case KeyPress:
+		widget->moved = True;
 		if (ev.xkey.window != widget->window)
 			continue;
 		event = keypress(widget, &ev.xkey, selitems, nitems, text);
@@ -2868,6 +3483,7 @@ mainmode(Widget *widget, int *selitems, int *nitems, char **text)
 			return event;
 		continue;
 	case ButtonPress:
+		widget->moved = True;
 		clickx = ev.xbutton.x;
 		clicky = ev.xbutton.y;
 		if (ev.xbutton.window != widget->window)
@@ -2879,6 +3495,8 @@ mainmode(Widget *widget, int *selitems, int *nitems, char **text)
 			widget->redraw = True;
 		} else if (ev.xbutton.button == Button2) {
 			event = scrollmode(widget, ev.xmotion.time, ev.xmotion.x, ev.xmotion.y);
+			if (event == WIDGET_NONE)
+				event = takewakeup(widget);
 			if (event != WIDGET_NONE)
 				return event;
 		} else if (ev.xbutton.button == Button3) {
@@ -2927,10 +3545,16 @@ mainmode(Widget *widget, int *selitems, int *nitems, char **text)
 			event = selmode(widget, ev.xmotion.state & (ShiftMask | ControlMask), clickx, clicky);
 		else
 			event = dragmode(widget, ev.xmotion.time, clicki, selitems, nitems);
+		if (event == WIDGET_NONE)
+			event = takewakeup(widget);
 		if (event != WIDGET_NONE)
 			return event;
 		continue;
 	case ClientMessage:
+		if (ev.xclient.message_type == atoms[_WIDGET_WAKEUP]) {
+			widget->wakeup = False;
+			return WIDGET_WAKEUP;
+		}
 		drop = ctrldnd_getdrop(
 			&ev, &atoms[UTF8_STRING], 1,
 			CTRLDND_ANYACTION, SCROLL_TIME,
@@ -3341,6 +3965,112 @@ initmisc(Widget *widget, struct Options *options)
 	return RETURN_SUCCESS;
 }
 
+static void
+freeshm(Widget *widget)
+{
+	int i;
+
+	if (widget->shm.img[0] == NULL)
+		return;
+	if (widget->shm.info.shmaddr != NULL)
+		(void)shmdt(widget->shm.info.shmaddr);
+	for (i = 0; i < SHM_SLOTS; i++) {
+		if (widget->shm.img[i] == NULL)
+			continue;
+		widget->shm.img[i]->data = NULL;
+		XDestroyImage(widget->shm.img[i]);
+		widget->shm.img[i] = NULL;
+	}
+}
+
+static int
+initshm(Widget *widget, struct Options *options)
+{
+	XErrorHandler handler;
+	XImage *img;
+	size_t size;
+	int i;
+	Bool attached;
+
+	(void)options;
+
+	/*
+	 * A server on another host may support MIT-SHM, but cannot map
+	 * our segment; attaching it then fails asynchronously.  So we
+	 * attach the segment right away, and wait for an error.  If
+	 * anything fails, thumbnails are written into the connection
+	 * with XPutImage(3), as usual; that is not an error.
+	 */
+	attached = False;
+	if (!XShmQueryExtension(widget->display))
+		return RETURN_SUCCESS;
+	img = XShmCreateImage(
+		widget->display,
+		widget->visual,
+		widget->depth,
+		ZPixmap,
+		NULL,
+		&widget->shm.info,
+		THUMBSIZE,
+		THUMBSIZE
+	);
+	if (img == NULL)
+		return RETURN_SUCCESS;
+	widget->shm.img[0] = img;
+	widget->shm.info.shmaddr = NULL;
+	if (img->bits_per_pixel != DATA_DEPTH * CHAR_BIT)
+		goto error;
+	for (i = 1; i < SHM_SLOTS; i++) {
+		widget->shm.img[i] = XShmCreateImage(
+			widget->display,
+			widget->visual,
+			widget->depth,
+			ZPixmap,
+			NULL,
+			&widget->shm.info,
+			THUMBSIZE,
+			THUMBSIZE
+		);
+		if (widget->shm.img[i] == NULL)
+			goto error;
+	}
+	size = (size_t)img->bytes_per_line * img->height;
+	widget->shm.info.shmid = shmget(
+		IPC_PRIVATE,
+		size * SHM_SLOTS,
+		IPC_CREAT | 0600
+	);
+	if (widget->shm.info.shmid == -1)
+		goto error;
+	widget->shm.info.shmaddr = shmat(widget->shm.info.shmid, NULL, 0);
+	if (widget->shm.info.shmaddr == (void *)-1)
+		widget->shm.info.shmaddr = NULL;
+	for (i = 0; widget->shm.info.shmaddr != NULL && i < SHM_SLOTS; i++)
+		widget->shm.img[i]->data = widget->shm.info.shmaddr + i * size;
+	widget->shm.info.readOnly = True;
+	widget->shm.completion = XShmGetEventBase(widget->display) + ShmCompletion;
+	if (img->data != NULL) {
+		XSync(widget->display, False);
+		shmfailed = False;
+		handler = XSetErrorHandler(shmerror);
+		attached = XShmAttach(widget->display, &widget->shm.info);
+		XSync(widget->display, False);
+		(void)XSetErrorHandler(handler);
+	}
+
+	/*
+	 * Mark the segment for removal now; it lives on until both we
+	 * and the server detach from it, even if we die.
+	 */
+	(void)shmctl(widget->shm.info.shmid, IPC_RMID, NULL);
+	if (img->data == NULL || !attached || shmfailed)
+		goto error;
+	return RETURN_SUCCESS;
+error:
+	freeshm(widget);
+	return RETURN_SUCCESS;
+}
+
 /*
  * public routines
  */
@@ -3353,6 +4083,8 @@ widget_free(Widget *widget)
 	if (widget == NULL)
 		return;
 	cleanwidget(widget);
+	widget->thumbbudget = 0;
+	keepthumbs(widget);
 	for (i = 0; i < widget->nicons; i++) {
 		if (widget->icons[i].pix != None) {
 			XFreePixmap(widget->display, widget->icons[i].pix);
@@ -3392,6 +4124,9 @@ widget_free(Widget *widget)
 		}
 	}
 	free(widget->icons);
+	if (widget->shm.img[0] != NULL)
+		(void)XShmDetach(widget->display, &widget->shm.info);
+	freeshm(widget);
 
 	if (widget->plainclip.stream != NULL)
 		fclose(widget->plainclip.stream);
@@ -3442,6 +4177,7 @@ widget_create(const char *class, const char *name, int argc, char *argv[], const
 		initicons,
 		initstreams,
 		initmisc,
+		initshm,
 	};
 
 	if ((widget = malloc(sizeof(*widget))) == NULL) {
@@ -3460,6 +4196,7 @@ widget_create(const char *class, const char *name, int argc, char *argv[], const
 		.colors[SELECT_YES][COLOR_FG].chans = COLOR(FF,FF,FF),
 		.status_enable = True,
 		.opacity = 0xFFFF,
+		.thumbbudget = DEF_THUMBMEM * 1024 * 1024,
 		.lock = PTHREAD_MUTEX_INITIALIZER,
 		.highlight = -1,
 		.itemw = ITEM_WIDTH,
@@ -3482,6 +4219,7 @@ widget_set(Widget *widget, const char *cwd, const char *title, Item items[], siz
 	cleanwidget(widget);
 	widget->items = items;
 	widget->nitems = nitems;
+	widget->moved = False;
 	if (scrl == NULL) {
 		widget->highlight = -1;
 		widget->ydiff = 0;
@@ -3495,27 +4233,16 @@ widget_set(Widget *widget, const char *cwd, const char *title, Item items[], siz
 		widget->row = scrl->row;
 	}
 	widget->title = title;
+	if ((widget->cwd = strdup(cwd)) == NULL) {
+		warn("strdup");
+		goto error;
+	}
 	(void)calcsize(widget, -1, -1);
 	if (scrl != NULL && widget->row >= widget->nscreens) {
 		widget->ydiff = 0;
 		setrow(widget, widget->nscreens - 1);
 	}
-	if ((widget->issel = calloc(widget->nitems, sizeof(*widget->issel))) == NULL) {
-		warn("calloc");
-		goto error;
-	}
-	if ((widget->linelen = calloc(widget->nitems, sizeof(*widget->linelen))) == NULL) {
-		warn("calloc");
-		goto error;
-	}
-	if ((widget->nlines = calloc(widget->nitems, sizeof(*widget->nlines))) == NULL) {
-		warn("calloc");
-		goto error;
-	}
-	if ((widget->thumbs = calloc(widget->nitems, sizeof(*widget->thumbs))) == NULL) {
-		warn("calloc");
-		goto error;
-	}
+	resetlabels(widget, widget->nlabels);
 	widget->thumbhead = NULL;
 	settitle(widget);
 	drawitems(widget);
@@ -3537,14 +4264,124 @@ error:
 	return RETURN_FAILURE;
 }
 
+int
+widget_update(Widget *widget, Item items[], size_t nitems, const int newindex[], size_t noldindex, Scroll *scrl)
+{
+	struct ItemState *states;
+	struct Selection *sel;
+	size_t i;
+	int j, top, anchor, offset, row;
+	Bool onhighlight;
+
+	/*
+	 * The items have been inserted, removed or moved around; but
+	 * most of them are the same.  Move the state we have for each
+	 * item (its selection and thumbnail) to its new index, rather
+	 * than starting anew as widget_set() does.
+	 *
+	 * newindex[i] is the new index of the item at the old index i,
+	 * or -1 if the item is gone.
+	 */
+	if (!widget->isset)
+		return RETURN_FAILURE;
+	states = NULL;
+	if (widget->states != NULL && (states = calloc(nitems, sizeof(*states))) == NULL) {
+		warn("calloc");
+		return RETURN_FAILURE;
+	}
+	resetclipboard(widget);
+	etlock(&widget->lock);
+
+	/*
+	 * Keep the highlighted item (or, if it is not on the screen, the
+	 * topmost item on the screen that is still there) at the same
+	 * row of the screen.
+	 */
+	anchor = -1;
+	offset = 0;
+	top = widget->row * widget->ncols;
+	onhighlight = widget->highlight >= top &&
+	              widget->highlight < top + widget->nrows * widget->ncols;
+	if (onhighlight) {
+		anchor = widget->highlight;
+	} else {
+		for (j = top; j < widget->nitems && (size_t)j < noldindex; j++) {
+			if (newindex[j] >= 0 && (size_t)newindex[j] < nitems) {
+				anchor = j;
+				break;
+			}
+		}
+	}
+	if (anchor >= 0)
+		offset = anchor / widget->ncols - widget->row;
+	for (i = 0; i < noldindex && i < (size_t)widget->nitems; i++) {
+		sel = getselection(widget, i);
+		if ((j = newindex[i]) < 0 || (size_t)j >= nitems) {
+			if (sel == NULL)
+				continue;
+			if (sel->next != NULL)
+				sel->next->prev = sel->prev;
+			if (sel->prev != NULL)
+				sel->prev->next = sel->next;
+			if (widget->sel == sel)
+				widget->sel = sel->next;
+			if (widget->rectsel == sel)
+				widget->rectsel = sel->next;
+			free(sel);
+			continue;
+		}
+		if (sel != NULL)
+			sel->index = (sel->index < 0) ? -j : j;
+		if (states != NULL)
+			states[j] = widget->states[i];
+	}
+	if (anchor >= 0 && !onhighlight)
+		anchor = newindex[anchor];
+	if (widget->highlight >= 0 && (size_t)widget->highlight < noldindex) {
+		if ((j = newindex[widget->highlight]) < 0)
+			j = min(widget->highlight, (int)nitems - 1);
+		if (onhighlight)
+			anchor = j;
+		widget->highlight = j;
+	}
+	free(widget->states);
+	widget->states = states;
+	resetlabels(widget, widget->nlabels);
+	widget->items = items;
+	widget->nitems = nitems;
+	etunlock(&widget->lock);
+	XUndefineCursor(widget->display, widget->window);
+	(void)calcsize(widget, -1, -1);
+	row = widget->row;
+	if (scrl != NULL && !widget->moved) {
+		/*
+		 * The items are coming in bit by bit, and the user has not
+		 * moved yet; keep going to where the caller wants us.
+		 */
+		widget->highlight = min(scrl->highlight, (int)nitems - 1);
+		row = scrl->row;
+	} else if (anchor >= 0) {
+		row = anchor / widget->ncols - offset;
+	}
+	row = max(0, min(row, widget->nscreens - 1));
+	if (row != widget->row) {
+		widget->ydiff = 0;
+		setrow(widget, row);
+	}
+	drawitems(widget);
+	drawstatusbar(widget);
+	commitdraw(widget);
+	return RETURN_SUCCESS;
+}
+
 void
 widget_map(Widget *widget)
 {
 	XMapWindow(widget->display, widget->window);
 }
 
-char *
-widget_geticons(Widget *widget)
+static char *
+getappresource(Widget *widget, XrmClass resclass, XrmName resname)
 {
 	XrmDatabase xdb;
 	char *str, *value, *p;
@@ -3557,8 +4394,8 @@ widget_geticons(Widget *widget)
 		xdb,
 		widget->application.class,
 		widget->application.name,
-		widget->resources[ICONS].class,
-		widget->resources[ICONS].name
+		resclass,
+		resname
 	);
 	if (value == NULL)
 		p = NULL;
@@ -3568,6 +4405,26 @@ widget_geticons(Widget *widget)
 	return p;
 }
 
+char *
+widget_geticons(Widget *widget)
+{
+	return getappresource(
+		widget,
+		widget->resources[ICONS].class,
+		widget->resources[ICONS].name
+	);
+}
+
+char *
+widget_getresource(Widget *widget, const char *class, const char *name)
+{
+	return getappresource(
+		widget,
+		XrmPermStringToQuark(class),
+		XrmPermStringToQuark(name)
+	);
+}
+
 WidgetEvent
 widget_poll(Widget *widget, int *selitems, int *nitems, Scroll *scrl, char **text)
 {
@@ -3580,6 +4437,8 @@ widget_poll(Widget *widget, int *selitems, int *nitems, Scroll *scrl, char **tex
 		*text = widget->gototext;
 		return WIDGET_GOTO;
 	}
+	if (takewakeup(widget) == WIDGET_WAKEUP)
+		return WIDGET_WAKEUP;
 	if (retval == WIDGET_CLOSE || retval == WIDGET_ERROR)
 		return retval;
 	widget->start = True;
@@ -3616,97 +4475,143 @@ widget_fd(Widget *widget)
 void
 widget_thumb(Widget *widget, char *path, int item)
 {
-	enum color_depths {
-		CLIP_DEPTH = 1,		/* 0/1 */
-		PPM_DEPTH = 3,		/* RGB */
-		DATA_DEPTH = 4,		/* BGRA */
-	};
-	FILE *fp;
-	size_t size, i;
+	struct Thumb *thumb, **bucket;
+	struct stat sb;
 	int w, h;
-	char buf[DATA_DEPTH];
 	unsigned char *data;
-	static unsigned char const PPM_HEADER[] = {'P', '6', '\n'};
-	static unsigned char const PPM_COLOR[] = {'2', '5', '5', '\n'};
 
-	if (item < 0 || item >= widget->nitems || widget->thumbs == NULL)
+	if (!widget->isset || item < 0 || item >= widget->nitems)
+		return;
+	if (allocstates(widget) == RETURN_FAILURE)
 		return;
 	data = NULL;
-	widget->thumbs[item] = NULL;
-	if ((fp = fopen(path, "rb")) == NULL) {
+	thumb = NULL;
+	widget->states[item].thumb = NULL;
+	if (stat(path, &sb) == -1) {
 		warn("%s", path);
-		goto error;
-	}
-	if (checkheader(fp, PPM_HEADER, sizeof(PPM_HEADER)) == -1) {
-		warnx("%s: not a ppm file", path);
-		goto error;
-	}
-	if ((w = readsize(fp)) <= 0 || (h = readsize(fp)) <= 0) {
-		warnx("%s: ppm file with invalid header", path);
-		goto error;
+		return;
 	}
-	if (w > THUMBSIZE || h > THUMBSIZE) {
-		warnx("%s: ppm file too large: %dx%d", path, w, h);
-		goto error;
+	bucket = thumbbucket(widget, path);
+	for (thumb = *bucket; thumb != NULL; thumb = thumb->hnext)
+		if (strcmp(thumb->path, path) == 0)
+			break;
+	if (thumb != NULL && thumb->size == sb.st_size &&
+	    thumb->mtime.tv_sec == sb.st_mtim.tv_sec &&
+	    thumb->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+		/* the file has not changed since; reuse the thumbnail */
+		if (thumb->kept) {
+			unkeepthumb(widget, thumb);
+			thumb->next = widget->thumbhead;
+			widget->thumbhead = thumb;
+		}
+		goto done;
 	}
-	if (checkheader(fp, PPM_COLOR, sizeof(PPM_COLOR)) == -1) {
-		warnx("%s: ppm file with invalid header", path);
-		goto error;
+	if (thumb != NULL) {
+		/* the file has changed; a thumbnail being shown is freed later */
+		unhashthumb(widget, thumb);
+		if (thumb->kept) {
+			unkeepthumb(widget, thumb);
+			freethumb(widget, thumb);
+		}
 	}
-	size = w * h;
-	if ((data = malloc(size * DATA_DEPTH)) == NULL) {
-		warn("malloc");
+	thumb = NULL;
+	if ((data = loadppm(path, &w, &h)) == NULL)
 		goto error;
-	}
-	for (i = 0; i < size; i++) {
-		if (fread(buf, 1, PPM_DEPTH, fp) != PPM_DEPTH) {
-			warn("%s", path);
-			goto error;
-		}
-		data[i * DATA_DEPTH + 0] = buf[2];   /* B */
-		data[i * DATA_DEPTH + 1] = buf[1];   /* G */
-		data[i * DATA_DEPTH + 2] = buf[0];   /* R */
-		data[i * DATA_DEPTH + 3] = 0xFF;     /* A */
-	}
-	fclose(fp);
-	fp = NULL;
-	if ((widget->thumbs[item] = malloc(sizeof(*widget->thumbs[item]))) == NULL) {
+	if ((thumb = malloc(sizeof(*thumb))) == NULL) {
 		warn("malloc");
 		goto error;
 	}
-	*widget->thumbs[item] = (struct Thumb){
+	*thumb = (struct Thumb){
+		.prev = NULL,
+		.next = widget->thumbhead,
+		.hnext = *bucket,
+		.path = strdup(path),
+		.mtime = sb.st_mtim,
+		.size = sb.st_size,
+		.kept = False,
 		.w = w,
 		.h = h,
-		.img = NULL,
-		.next = widget->thumbhead,
+		.pix = None,
+		.pict = None,
 	};
-	widget->thumbs[item]->img = XCreateImage(
+	if (thumb->path == NULL) {
+		warn("strdup");
+		goto error;
+	}
+
+	/*
+	 * Upload the thumbnail into a pixmap once, and forget the pixels;
+	 * drawing the item composites the picture on the server.
+	 */
+	thumb->pix = XCreatePixmap(
 		widget->display,
-		widget->visual,
-		widget->depth,
-		ZPixmap,
-		0, (char *)data,
+		widget->window,
 		w, h,
-		DATA_DEPTH * CHAR_BIT,
-		0
+		widget->depth
 	);
-	if (widget->thumbs[item]->img == NULL) {
+	if (putthumb(widget, thumb->pix, data, w, h) == RETURN_FAILURE) {
 		warnx("%s: could not allocate XImage", path);
+		XFreePixmap(widget->display, thumb->pix);
+		free(thumb->path);
 		goto error;
 	}
-	XInitImage(widget->thumbs[item]->img);
-	widget->thumbhead = widget->thumbs[item];
+	free(data);
+	thumb->pict = XRenderCreatePicture(
+		widget->display,
+		thumb->pix,
+		widget->format,
+		0,
+		NULL
+	);
+	*bucket = thumb;
+	widget->thumbhead = thumb;
+	widget->thumbbytes += (size_t)w * h * DATA_DEPTH;
+	trimthumbs(widget);
+done:
+	widget->states[item].thumb = thumb;
 	if (item >= widget->row * widget->ncols && item < widget->row * widget->ncols + widget->nrows * widget->ncols) {
 		drawitem(widget, item);
 		commitdraw(widget);
 	}
 	return;
 error:
-	if (fp != NULL)
-		fclose(fp);
 	free(data);
-	free(widget->thumbs[item]);
-	widget->thumbs[item] = NULL;
+	free(thumb);
+}
+
+void
+widget_wakeup(Widget *widget)
+{
+	/*
+	 * This is called from other threads.  The message goes through
+	 * the server back to us, waking up the main thread from poll(2).
+	 */
+	XSendEvent(
+		widget->display, widget->window, False, NoEventMask,
+		&(XEvent){ .xclient = {
+			.type = ClientMessage,
+			.display = widget->display,
+			.window = widget->window,
+			.message_type = atoms[_WIDGET_WAKEUP],
+			.format = 32,
+		}}
+	);
+	XFlush(widget->display);
+}
+
+void
+widget_onhighlight(Widget *widget, void (*fn)(void *, int), void *arg)
+{
+	widget->highlightfn = fn;
+	widget->highlightarg = arg;
+}
+
+void
+widget_onscroll(Widget *widget, void (*fn)(void *, int, int), void *arg)
+{
+	widget->scrollfn = fn;
+	widget->scrollarg = arg;
+	widget->scrollfirst = widget->scrolllast = -1;
 }
 
 void
@@ -5,11 +5,17 @@ typedef struct Scroll {
 } Scroll;
 
 typedef struct Item {
+	char *name;             /* item name (relative to the directory) */
+
+	/* metadata for the statusbar */
+	off_t size;
+	time_t mtime;
+	uid_t uid;
+	gid_t gid;
+
+	/* kept last and narrow, so they pack into the same word */
+	unsigned short icon;    /* index for the icon array */
 	unsigned char mode;     /* entry mode */
-	char *name;             /* item display name */
-	char *fullname;         /* item full name */
-	char *status;           /* item statusbar info */
-	size_t icon;            /* index for the icon array */
 } Item;
 
 typedef enum {
@@ -26,6 +32,7 @@ typedef enum {
 	WIDGET_DROPCOPY,
 	WIDGET_DROPMOVE,
 	WIDGET_DROPLINK,
+	WIDGET_WAKEUP,
 	WIDGET_ERROR,
 } WidgetEvent;
 
@@ -48,9 +55,26 @@ int widget_set(
 	Scroll *scrl
 );
 
+/*
+ * replace items, keeping the state of those at newindex[oldindex];
+ * if scrl is not NULL, scroll to it unless the user has moved since
+ * widget_set()
+ */
+int widget_update(
+	Widget *widget,
+	Item *items,
+	size_t nitems,
+	const int *newindex,
+	size_t noldindex,
+	Scroll *scrl
+);
+
 /* get value of icons resource into allocated string */
 char *widget_geticons(Widget *widget);
 
+/* get value of a resource only the caller knows about into allocated string */
+char *widget_getresource(Widget *widget, const char *class, const char *name);
+
 WidgetEvent widget_wait(Widget *widget);
 
 int widget_fd(Widget *widget);
@@ -61,6 +85,15 @@ WidgetEvent widget_poll(Widget *widget, int *selitems, int *nselitems, Scroll *s
 
 void widget_thumb(Widget *widget, char *path, int index);
 
+/* make widget_poll() return WIDGET_WAKEUP; can be called from any thread */
+void widget_wakeup(Widget *widget);
+
+/* call fn(arg, index) whenever another item gets highlighted */
+void widget_onhighlight(Widget *widget, void (*fn)(void *, int), void *arg);
+
+/* call fn(arg, first, last) whenever other items get on the screen */
+void widget_onscroll(Widget *widget, void (*fn)(void *, int, int), void *arg);
+
 void widget_free(Widget *widget);
 
 void widget_busy(Widget *widget);
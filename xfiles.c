@@ -1,20 +1,32 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
-#include <grp.h>
 #include <limits.h>
-#include <pwd.h>
 #include <poll.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <wctype.h>
 
 #include "util.h"
 #include "widget.h"
@@ -32,17 +44,310 @@
 #define MAX_RESOURCES   32      /* actually 31, the last must be NULL */
 #define URI_PREFIX      "file://"
 #define INCRSIZE        512
+#define FIRSTBATCH      128     /* entries read before the first paint */
+#define STATCHUNK       16      /* entries stat(2)ed by a thread at a time */
+#define NSTATTHREADS    8       /* maximum threads stat(2)ing entries */
+#define PREFETCHBATCH   256     /* entries prefetched between checks for cancelling */
+#define REVALBATCH      128     /* entries revalidated between checks for cancelling */
+#define LOADBATCH       1024    /* entries read or stat(2)ed between checks for cancelling */
+#define RADIXMIN        64      /* fewer entries than that are just qsort(3)ed */
+#define KEYRANKSHIFT    56      /* the rank goes in the top byte of a key prefix */
+#define KEYBUFSIZE      1024    /* collation keys shorter than that need no malloc(3) */
+#define HUGEDIR         65536   /* directories with that many entries keep no collation keys */
+#define ICONCACHESIZE   256     /* (extension, mode) pairs whose icon is remembered */
+#define ICONEXTSIZE     16      /* longer extensions are not remembered */
 #define DEF_OPENER      "xdg-open"
 #define CONTEXTCMD      "xfilesctl"
 #define THUMBNAILERCMD  "xfilesthumb"
 #define DEV_NULL        "/dev/null"
-#define UNIT_LAST       7
-#define STATUS_BUFSIZE  1024
+#define DIRCACHE_CLASS  "DirectoryCacheSize"
+#define DIRCACHE_NAME   "directoryCacheSize"
+#define DEF_DIRCACHE    32      /* default budget for the directory cache, in MiB */
+#define METACACHE_CLASS "MetadataCache"
+#define METACACHE_NAME  "metadataCache"
+#define THUMBJOBS_CLASS "ThumbnailJobs"
+#define THUMBJOBS_NAME  "thumbnailJobs"
+#define MAXTHUMBJOBS    256     /* maximum thumbnailers run at a time */
+#define THUMBTIME_CLASS "ThumbnailTimeout"
+#define THUMBTIME_NAME  "thumbnailTimeout"
+#define DEF_THUMBTIME   30      /* default seconds a thumbnailer can take */
+#define THUMBPOLLMAX    50      /* maximum milliseconds between checks for a thumbnailer, where it cannot be polled */
+#define THUMBCOPROC_CLASS "ThumbnailCoprocess"
+#define THUMBCOPROC_NAME  "thumbnailCoprocess"
+#define THUMBSIZE       64      /* size of thumbnails, in pixels */
+#define REPLYSIZE       64      /* longest reply from a thumbnailer coprocess */
+#define NOTFOUND        127     /* exit status for a command not found */
+#define METADIR         "metadata"      /* under the thumbnail directory */
+#define METAMAGIC       "XFMETA2\n"
+
+#ifdef __linux__
+#define WATCHBUFSIZE    4096    /* buffer for reading inotify(7) events */
+#define WATCHMASK       (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                         IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+enum {
+	UPDATE_DONE,            /* entries are up to date */
+	UPDATE_RELOAD,          /* directory must be read again */
+	UPDATE_ERROR,           /* directory cannot be checked */
+};
+
+enum {
+	THUMB_CREATED,          /* thumbnailer created the thumbnail */
+	THUMB_FAILED,           /* thumbnailer could not create it */
+	THUMB_ABORTED,          /* thumbnailer timed out, was killed, or misbehaved */
+	THUMB_FORK,             /* coprocess cannot be used, fork a thumbnailer */
+};
+
+enum {
+	/* states of the entries in fm->thumbpending */
+	PENDING_NO,             /* entry is thumbnailed, or not to be */
+	PENDING_YES,            /* entry is to be thumbnailed */
+	PENDING_TAKEN,          /* entry is being thumbnailed */
+};
 
 struct FileType {
 	char *patt, *name;
 };
 
+enum {
+	/* shapes of icon patterns, see compileicons() */
+	SHAPE_ANY,              /* "*" */
+	SHAPE_NAME,             /* "name" */
+	SHAPE_EXT,              /* "*.ext" */
+	SHAPE_PREFIX,           /* "prefix*" */
+	SHAPE_SUFFIX,           /* "*suffix" */
+	SHAPE_GLOB,             /* anything else, left to fnmatch(3) */
+};
+
+struct IconRule {
+	struct IconPatt *patt;
+	struct IconRule *next;  /* next rule in the same bucket */
+	char *lit;              /* literal part of the pattern, case folded */
+	size_t len;             /* its length */
+	int shape;
+	bool byext;             /* whether a name with an extension matches by it alone */
+};
+
+struct IconCache {
+	struct IconRule *rule;  /* first rule matching by extension, or NULL */
+	char ext[ICONEXTSIZE];  /* extension, case folded */
+	unsigned char mode;
+	bool valid;
+};
+
+struct IconMatcher {
+	/*
+	 * The icon patterns, compiled for geticon().  There is a rule for
+	 * each pattern, in the order they are tried; as the first match
+	 * wins, a rule wins over those after it in rules[].
+	 */
+	struct IconRule *rules;
+	struct IconRule **exts;         /* SHAPE_EXT rules, hashed by extension */
+	struct IconRule **names;        /* SHAPE_NAME rules, hashed by name */
+	struct IconRule **extrules;     /* other rules matching by extension, in order */
+	struct IconRule **others;       /* the other rules, in order */
+	size_t nrules, nbuckets, nextrules, nothers;
+	unsigned char fold[128];        /* how fnmatch(3) folds the case of ASCII */
+
+	/*
+	 * Which of the rules matching by extension alone is the first
+	 * to match each (extension, mode) pair seen recently.  The
+	 * rules matching by name or path (which may be on "~" or "/")
+	 * are still tried for each entry.
+	 */
+	pthread_mutex_t lock;
+	struct IconCache cache[ICONCACHESIZE];
+#ifdef DEBUG
+	unsigned long hits, misses;
+#endif
+};
+
+struct EntryStat {
+	struct stat sb;         /* lstat(2) of the entry */
+	int errnum;             /* errno from lstat(2), or 0 */
+};
+
+struct SortKey {
+	uint64_t prefix;        /* rank and first bytes of the collation key */
+	char *key;              /* collation key, from strxfrm(3); or the name */
+	int index;              /* index of the entry in fm->dir.entries */
+	bool isname;            /* key is the name, compare with strcoll(3) */
+};
+
+struct Dir {
+	Item *entries;
+	struct SortKey *keys;   /* sorting keys of entries, in the same order */
+	struct Arena arena;     /* memory for the names of entries */
+	struct Arena keyarena;  /* memory for the collation keys */
+	int nentries;           /* number of entries */
+	int capacity;           /* capacity of entries */
+	bool huge;              /* keys are names, rather than collation keys */
+};
+
+struct MetaHeader {
+	/*
+	 * A file in the metadata cache is this header, followed by an
+	 * array of records (one per entry, in the order the entries are
+	 * sorted), followed by the names of the entries, each one ended
+	 * by a nul byte.  The file is mmap(2)ed and read in place.
+	 */
+	char magic[8];
+	uint32_t nentries;
+	uint32_t namesize;      /* size of the names, after the records */
+	int64_t mtime[2];       /* mtime of the directory, seconds and nanoseconds */
+	int64_t ctime[2];       /* ctime of the directory, seconds and nanoseconds */
+};
+
+struct MetaRecord {
+	int64_t size;
+	int64_t mtime;
+	uint32_t name;          /* offset of the name of the entry */
+	uint32_t uid;
+	uint32_t gid;
+	uint8_t mode;
+	uint8_t pad[3];
+};
+
+struct WatchName {
+	char *name;             /* name of an entry an event was about */
+	int index;              /* index of the entry with that name, or -1 */
+};
+
+struct WatchEvents {
+	struct WatchName *names;
+	struct Arena arena;     /* memory for the names */
+	int nnames;
+	int capacity;
+	bool reload;            /* whether events have been lost */
+};
+
+struct Snapshot {
+	/*
+	 * The entries of a directory we have left, kept for when we get
+	 * back to it.  A snapshot is only used while the directory has
+	 * not changed since we left it.
+	 */
+	struct Snapshot *prev, *next;
+	char *path;             /* absolute path of the directory */
+	struct timespec time;   /* ctime of the directory */
+	struct Dir dir;
+	int watch;              /* watch descriptor on the directory, or -1 */
+	bool stale;             /* whether we got events about the directory */
+	size_t size;            /* memory used by the snapshot */
+};
+
+struct Prefetch {
+	/*
+	 * The prefetcher thread reads (into a snapshot) the directory
+	 * highlighted by the user, before the user opens it.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;           /* whether the thread has been created */
+	bool exit;              /* whether the thread must exit */
+	unsigned long gen;      /* bumped at each request, cancelling the previous */
+	char *path;             /* directory requested, or NULL */
+
+	/* the last directory prefetched */
+	struct Dir dir;
+	char *donepath;         /* its canonical path, or NULL */
+	struct timespec time;   /* its ctime */
+};
+
+struct ThumbDir {
+	/*
+	 * A descriptor of the directory whose entries are thumbnailed,
+	 * for the thumbnailer threads to stat(2) them relative to.  Each
+	 * thread holds a reference while it thumbnails an entry; so we
+	 * can change directory (and close fm->dirfd) without waiting for
+	 * the threads to be done with the entries of the previous one.
+	 */
+	int fd;
+	int refs;               /* threads using it, plus one if still current */
+};
+
+struct ThumbJob {
+	/*
+	 * An entry being thumbnailed by a thumbnailer thread.  Its index
+	 * is kept up to date as the view is rebuilt, for the thumbnail
+	 * to be given to the widget under the index the entry has then.
+	 */
+	struct ThumbJob *next;
+	struct ThumbDir *dir;   /* its directory, or NULL */
+	int index;              /* index in the view, or -1 if no longer there */
+};
+
+struct Coproc {
+	/*
+	 * A thumbnailer run in loop mode ("xfilesthumb -l") by a thread
+	 * of the thumbnailer pool.  Rather than running a thumbnailer for
+	 * each file, the thread writes to its coprocess, over a socket,
+	 * the file to be thumbnailed, the thumbnail to be created and
+	 * its size, a line each; and reads back a line with "ok" (and
+	 * the size of the thumbnail) or "fail".
+	 */
+	pid_t pid;              /* the coprocess, or -1 if not running */
+	int fd;                 /* our end of the socket */
+	bool failed;            /* whether to run a thumbnailer for each file instead */
+	size_t len;             /* bytes read from the socket but not yet parsed */
+	char reply[REPLYSIZE];  /* those bytes; the next reply begins here */
+};
+
+struct Revalidate {
+	/*
+	 * The revalidator thread stat(2)s again, in the background, the
+	 * entries of a directory that have been read from the metadata
+	 * cache; they may have changed since the cache was written.
+	 */
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool running;           /* whether the thread has been created */
+	bool cancel;            /* whether the thread must give up */
+	bool done;              /* whether the thread has stat(2)ed all entries */
+	struct Dir dir;         /* copy of the entries being revalidated */
+	int dirfd;              /* their directory */
+	char *path;             /* its path */
+};
+
+struct Load {
+	/*
+	 * The loader thread reads the directory we have changed into, in
+	 * the background; the main thread shows the entries read so far
+	 * whenever it is woken up.  Entries are given to the main thread
+	 * as a copy (but the last time, when the thread is done with
+	 * them), along with the map from the entries it has shown last
+	 * into those; so it can keep the state the user has given to
+	 * them (see widget_update()).
+	 */
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool running;           /* whether the thread has been created */
+	bool cancel;            /* whether the thread must give up */
+	bool ready;             /* whether there are entries to be shown */
+	bool done;              /* whether the thread has read all entries */
+	struct Dir dir;         /* entries being read, owned by the thread */
+	Item *entries;          /* copy of the entries to be shown */
+	int nentries;
+	int *newindex;          /* index in entries of each entry shown last */
+	int nold;               /* number of entries shown last */
+	DIR *dirp;              /* directory being read */
+	char *path;             /* its path */
+	Scroll scrl;            /* where to scroll to as entries come in */
+};
+
+struct StatJob {
+	pthread_mutex_t lock;
+	struct FM *fm;
+	int dirfd;
+	Item *entries;
+	struct EntryStat *stats;
+	int next;               /* next entry to be stat(2)ed */
+	int nentries;
+};
+
 struct Cwd {
 	struct Cwd *prev, *next;
 	Scroll scrl;            /* scrolling position on this directory */
@@ -52,11 +357,16 @@ struct Cwd {
 
 struct FM {
 	Widget *widget;
-	Item *entries;
+	struct Dir dir;         /* entries of the current directory, dotentries included */
+	Item *view;             /* entries given to the widget */
+	Item *viewbuf;          /* copy of the entries in the view, if some are hidden */
+	int *viewmap;           /* index in fm->dir.entries of each entry in the view */
+	int nview;
+	int dirfd;              /* open directory the entries were read from */
+	int watchfd;            /* inotify(7) instance, or -1 */
+	int watch;              /* watch descriptor on the directory, or -1 */
 	int widgetfd;           /* file descriptor for widget events */
-	int *selitems;          /* array of indices to selected items */
-	int capacity;           /* capacity of entries */
-	int nentries;           /* number of entries */
+	int *selitems;          /* array of indices to selected entries in the view */
 	char *home;
 	size_t homelen;
 	struct Cwd *cwd;        /* pointer to current working directories */
@@ -64,18 +374,61 @@ struct FM {
 	struct Cwd *last;       /* last working directories */
 	struct timespec time;   /* ctime of current directory */
 
+	/* cache of directory snapshots, most recently used first */
+	struct Snapshot *snaphead;
+	struct Snapshot *snaptail;
+	size_t snapsize;        /* memory used by the snapshots */
+	size_t snapbudget;      /* maximum memory used by the snapshots */
+	struct Prefetch prefetch;
+
+	/* on-disk cache of the metadata of entries */
+	char *metadir;          /* directory with the cache, or NULL */
+	bool metadirty;         /* whether the cache is out of date with the entries */
+	struct Revalidate reval;
+	struct Load load;
+
 	/* user-defined icon globbing patterns */
 	struct IconPatt *userpatts;
 	size_t nuserpatts;
+	struct IconMatcher icons;       /* user-defined and hardcoded patterns, compiled */
 
 	uid_t uid;
 	gid_t gid;
 	gid_t grps[NGROUPS_MAX];
 	int ngrps;
 
+	/*
+	 * Entries are thumbnailed by a pool of threads, each running
+	 * one thumbnailer at a time; they take the next entry to be
+	 * thumbnailed (see thumbtake()), and kill a thumbnailer that
+	 * takes longer than thumbtimeout seconds.
+	 *
+	 * The view can be rebuilt, or another directory opened, while
+	 * they run, under both locks.  The entries being thumbnailed
+	 * are then moved to their new indices; the thumbnails of those
+	 * no longer in the view are dropped (see thumbfinish()).  The
+	 * threads are only waited for on exit; a thread still busy with
+	 * such a stale entry is not counted in the pool, so another one
+	 * is created in its place (see createthumbthread()).
+	 */
 	pthread_mutex_t thumblock;
-	pthread_t thumbthread;
+	pthread_mutex_t thumbdrawlock;  /* serializes the calls to widget_thumb() */
+	pthread_cond_t thumbcond;       /* signaled when a thumbnailer thread exits */
+	struct ThumbDir *thumbdir;      /* directory of the view, or NULL */
+	struct ThumbJob *thumbjobs;     /* entries being thumbnailed */
+	int nthumbthreads;      /* number of thumbnailer threads running */
+	int nthumbtaken;        /* number of entries being thumbnailed */
+	int nthumbstale;        /* number of those no longer in the view */
+	int nthumbjobs;         /* maximum number of thumbnailer threads */
+	int thumbtimeout;       /* or 0 for no timeout */
+	bool thumbcoproc;       /* whether to run thumbnailers in loop mode */
 	int thumbexit;
+	char *thumbpending;     /* PENDING_* state of each entry in the view */
+	int nthumbpending;      /* number of entries to be thumbnailed */
+	int thumbfirst;         /* first entry on the screen */
+	int thumblast;          /* last entry on the screen */
+	int thumbbelow;         /* no entry from thumbfirst to here is pending */
+	int thumbabove;         /* no entry from here to thumbfirst is pending */
 	char *thumbnaildir;
 	size_t thumbnaildirlen;
 
@@ -84,19 +437,6 @@ struct FM {
 
 static int hide = 1;
 
-static struct {
-	char u;
-	long long int n;
-} units[UNIT_LAST] = {
-	{ 'B', 1LL },
-	{ 'K', 1024LL },
-	{ 'M', 1024LL * 1024 },
-	{ 'G', 1024LL * 1024 * 1024 },
-	{ 'T', 1024LL * 1024 * 1024 * 1024 },
-	{ 'P', 1024LL * 1024 * 1024 * 1024 * 1024 },
-	{ 'E', 1024LL * 1024 * 1024 * 1024 * 1024 * 1024 },
-};
-
 static void
 usage(void)
 {
@@ -115,128 +455,35 @@ wchdir(const char *path)
 }
 
 static int
-direntselect(const struct dirent *dp)
+direntselect(const char *name)
 {
-	if (strcmp(dp->d_name, ".") == 0)
-		return false;
-	if (strcmp(dp->d_name, "..") == 0)
-		return true;
-	if (hide && dp->d_name[0] == '.')
-		return false;
-	return true;
+	/* dotentries are read too; they are hidden from the view */
+	return strcmp(name, ".") != 0;
 }
 
-static void
-freeentries(struct FM *fm)
+static int
+direnthidden(const char *name)
 {
-	int i;
-
-	for (i = 0; i < fm->nentries; i++) {
-		free(fm->entries[i].name);
-		free(fm->entries[i].fullname);
-		free(fm->entries[i].status);
-	}
+	return hide && name[0] == '.' && strcmp(name, "..") != 0;
 }
 
 static char *
-fullpath(char *dir, char *file)
+fullpath(char *buf, const char *dir, const char *file)
 {
-	char buf[PATH_MAX];
-
 	if (strcmp(dir, "/") == 0)
 		dir = "";
-	(void)snprintf(buf, sizeof(buf), "%s/%s", dir, file);
-	return estrdup(buf);
+	(void)snprintf(buf, PATH_MAX, "%s/%s", dir, file);
+	return buf;
 }
 
 static char *
-statusfmt(struct stat *sb)
+entrypath(struct FM *fm, int index, char *buf)
 {
-	int i;
-	time_t time;
-	long long int number, fract;
-	struct passwd *pw = NULL;
-	struct group *gr = NULL;
-	struct tm tm;
-	char *user = "?";
-	char *group = "";
-	char *sep = "";
-	char timebuf[128];
-	char buf[STATUS_BUFSIZE] = "???";
-
-	number = 0;
-	if (sb->st_size <= 0)
-		goto done;
-	for (i = 0; i < UNIT_LAST; i++)
-		if (sb->st_size < units[i + 1].n)
-			break;
-	if (i == UNIT_LAST)
-		goto done;
-	fract = (i == 0) ? 0 : sb->st_size % units[i].n;
-	fract /= (i == 0) ? 1 : units[i - 1].n;
-	fract = (10 * fract + 512) / 1024;
-	number = sb->st_size / units[i].n;
-	if (number <= 0)
-		goto done;
-	if (fract >= 10 || (fract >= 5 && number >= 100)) {
-		number++;
-		fract = 0;
-	} else if (fract < 0) {
-		fract = 0;
-	}
-done:
-	pw = getpwuid(sb->st_uid);
-	gr = getgrgid(sb->st_gid);
-	if (gr != NULL && gr->gr_name != NULL)
-		group = gr->gr_name;
-	if (pw != NULL && pw->pw_name != NULL) {
-		user = pw->pw_name;
-		if (strcmp(user, group) == 0) {
-			group = "";
-		} else {
-			sep = ":";
-		}
-	}
-	time = sb->st_mtim.tv_sec;
-	(void)localtime_r(&time, &tm);
-	(void)strftime(timebuf, sizeof(timebuf), "%F %R", &tm);
-	if (number <= 0) {
-		(void)snprintf(
-			buf,
-			sizeof(buf),
-			"0B - %s%s%s - %s",
-			user,
-			sep,
-			group,
-			timebuf
-		);
-	} else if (number >= 100) {
-		(void)snprintf(
-			buf,
-			sizeof(buf),
-			"%lld%c - %s%s%s - %s",
-			number,
-			units[i].u,
-			user,
-			sep,
-			group,
-			timebuf
-		);
-	} else {
-		(void)snprintf(
-			buf,
-			sizeof(buf),
-			"%lld.%lld%c - %s%s%s - %s",
-			number,
-			fract,
-			units[i].u,
-			user,
-			sep,
-			group,
-			timebuf
-		);
-	}
-	return estrdup(buf);
+	/*
+	 * Entries only hold their names; their full path is built from
+	 * the path of the directory they were read from when it is needed.
+	 */
+	return fullpath(buf, fm->last->path, fm->view[index].name);
 }
 
 static int
@@ -246,42 +493,19 @@ isdir(Item *entry)
 }
 
 static int
-entrycmp(const void *ap, const void *bp)
-{
-	int aisdir, bisdir;
-	Item *a, *b;
-
-	a = (Item *)ap;
-	b = (Item *)bp;
-	/* dotdot (parent directory) first */
-	if (strcmp(a->name, "..") == 0)
-		return -1;
-	if (strcmp(b->name, "..") == 0)
-		return 1;
-
-	/* directories first */
-	aisdir = isdir(a);
-	bisdir = isdir(b);
-	if (aisdir && !bisdir)
-		return -1;
-	if (bisdir && !aisdir)
-		return 1;
-
-	/* dotentries (hidden entries) first */
-	if (a->name[0] == '.' && b->name[0] != '.')
-		return -1;
-	if (b->name[0] == '.' && a->name[0] != '.')
-		return 1;
-	return strcoll(a->name, b->name);
-}
-
-static int
-setthumbpath(struct FM *fm, char *orig, char *thumb)
+setthumbpath(struct FM *fm, Item *entry, char *orig, char *thumb)
 {
 	char buf[PATH_MAX];
 	int i;
 
-	if (realpath(orig, buf) == NULL)
+	/*
+	 * The path of the directory comes from getcwd(3), and so it is
+	 * already canonical; only symbolic links need to be resolved to
+	 * get the path the thumbnail is named after.
+	 */
+	if (!(entry->mode & MODE_LINK))
+		(void)snprintf(buf, PATH_MAX, "%s", orig);
+	else if (realpath(orig, buf) == NULL)
 		return RETURN_FAILURE;
 	for (i = 0; buf[i] != '\0'; i++)
 		if (buf[i] == '/')
@@ -290,17 +514,151 @@ setthumbpath(struct FM *fm, char *orig, char *thumb)
 	return RETURN_SUCCESS;
 }
 
+static void
+thumbrestart(struct FM *fm)
+{
+	/* look for the entries to be thumbnailed from the screen on */
+	fm->thumbbelow = max(fm->thumbfirst, 0);
+	fm->thumbabove = fm->thumbbelow - 1;
+}
+
+static void
+thumbremap(struct FM *fm, const int *viewindex)
+{
+	struct ThumbJob *job;
+
+	/*
+	 * The view has been rebuilt; viewindex[i] is the new index of
+	 * the entry that was at i, or -1 if it is gone (a NULL viewindex
+	 * means all of them are).  Move the entries being thumbnailed.
+	 */
+	for (job = fm->thumbjobs; job != NULL; job = job->next) {
+		if (job->index < 0)
+			continue;
+		job->index = (viewindex != NULL) ? viewindex[job->index] : -1;
+		if (job->index < 0)
+			fm->nthumbstale++;
+		else
+			fm->thumbpending[job->index] = PENDING_TAKEN;
+	}
+	thumbrestart(fm);
+}
+
+static void
+thumbhold(struct FM *fm)
+{
+	/*
+	 * The entries are about to be changed in place; keep the
+	 * thumbnailers off the view until updateview() rebuilds it.
+	 * The entries being thumbnailed are left alone, for they have
+	 * been copied by their thumbnailers.
+	 */
+	etlock(&fm->thumblock);
+	fm->nthumbpending = 0;
+	etunlock(&fm->thumblock);
+}
+
+static void
+thumbdirdrop(struct ThumbDir *td)
+{
+	if (td == NULL || --td->refs > 0)
+		return;
+	(void)close(td->fd);
+	free(td);
+}
+
 static int
-thumbexit(struct FM *fm)
+thumbtake(struct FM *fm, struct ThumbJob *job, Item *entry, char *orig)
 {
-	int ret;
+	int i, below, above;
+
+	/*
+	 * Take the next entry to be thumbnailed, or return -1 if there
+	 * are none left or we must exit.  The entries on the screen go
+	 * first; then the entries nearest to the screen, going down
+	 * from its bottom and up from its top.
+	 *
+	 * The entry and its path are copied, for the view can change
+	 * once we unlock.  A thread exits if it would make the pool
+	 * larger than nthumbjobs; see createthumbthread().
+	 */
+	i = -1;
+	etlock(&fm->thumblock);
+	if (fm->thumbexit || fm->nthumbpending == 0 ||
+	    fm->nthumbthreads - fm->nthumbstale > fm->nthumbjobs)
+		goto done;
+	below = fm->thumbbelow;
+	above = min(fm->thumbabove, fm->nview - 1);
+	while (below < fm->nview && fm->thumbpending[below] != PENDING_YES)
+		below++;
+	while (above >= 0 && fm->thumbpending[above] != PENDING_YES)
+		above--;
+	fm->thumbbelow = below;
+	fm->thumbabove = above;
+	if (below < fm->nview && (above < 0 || below <= fm->thumblast ||
+	    below - fm->thumblast <= fm->thumbfirst - above))
+		i = below;
+	else if (above >= 0)
+		i = above;
+	else
+		goto done;
+	fm->thumbpending[i] = PENDING_TAKEN;
+	fm->nthumbpending--;
+	fm->nthumbtaken++;
+	*entry = fm->view[i];
+	(void)entrypath(fm, i, orig);
+	entry->name = strrchr(orig, '/') + 1;
+	job->index = i;
+	if ((job->dir = fm->thumbdir) != NULL)
+		job->dir->refs++;
+	job->next = fm->thumbjobs;
+	fm->thumbjobs = job;
+done:
+	if (i == -1) {
+		fm->nthumbthreads--;
+		etsignal(&fm->thumbcond);
+	}
+	etunlock(&fm->thumblock);
+	return i;
+}
+
+static int
+thumbfinish(struct FM *fm, struct ThumbJob *job)
+{
+	struct ThumbJob **p;
+	int i;
 
-	ret = 0;
+	/*
+	 * Done with the entry we took; return its index now, or -1 if
+	 * it is no longer in the view.  The caller holds thumbdrawlock,
+	 * so the index does not change until the widget gets it.
+	 */
 	etlock(&fm->thumblock);
-	if (fm->thumbexit)
-		ret = 1;
+	for (p = &fm->thumbjobs; *p != job; p = &(*p)->next)
+		;
+	*p = job->next;
+	if ((i = job->index) >= 0)
+		fm->thumbpending[i] = PENDING_NO;
+	else
+		fm->nthumbstale--;
+	fm->nthumbtaken--;
+	thumbdirdrop(job->dir);
+	etunlock(&fm->thumblock);
+	return i;
+}
+
+static void
+scrolled(void *arg, int first, int last)
+{
+	struct FM *fm;
+
+	/* called by the widget when other entries get on the screen */
+	fm = (struct FM *)arg;
+	etlock(&fm->thumblock);
+	fm->thumbfirst = first;
+	fm->thumblast = last;
+	thumbrestart(fm);
 	etunlock(&fm->thumblock);
-	return ret;
 }
 
 static pid_t
@@ -309,250 +667,2439 @@ forkthumb(char *orig, char *thumb)
 	pid_t pid;
 
 	if ((pid = efork()) == 0) {
-		/* child */
+		/* child; in a group of its own, so it can be killed with what it runs */
+		(void)setpgid(0, 0);
 		eclose(STDOUT_FILENO);
 		eclose(STDIN_FILENO);
-		eexec((char *[]){
+		/* not eexec(), which exits as if the thumbnailer failed */
+		(void)execvp(THUMBNAILERCMD, (char *[]){
 			THUMBNAILERCMD,
 			orig,
 			thumb,
 			NULL,
 		});
-		err(EXIT_FAILURE, "%s", THUMBNAILERCMD);
+		err(NOTFOUND, "%s", THUMBNAILERCMD);
+	}
+	return pid;
+}
+
+static int
+timespeclt(struct timespec *tsp, struct timespec *usp)
+{
+	return (tsp->tv_sec == usp->tv_sec)
+	     ? (tsp->tv_nsec < usp->tv_nsec)
+	     : (tsp->tv_sec < usp->tv_sec);
+}
+
+static bool
+checkmode(struct IconPatt *icon, Item *entry)
+{
+	return ((icon->mode & MODE_MASK) == MODE_ANY ||
+	        (icon->mode & MODE_MASK) == (entry->mode & MODE_MASK)) &&
+	       (!(icon->mode & MODE_LINK) || (entry->mode & MODE_LINK)) &&
+	       (!(icon->mode & MODE_EXEC) || (entry->mode & MODE_EXEC)) &&
+	       (!(icon->mode & MODE_READ) || (entry->mode & MODE_READ)) &&
+	       (!(icon->mode & MODE_WRITE) || (entry->mode & MODE_WRITE));
+}
+
+static bool
+checkicon(struct FM *fm, const char *path, Item *entry, struct IconPatt *icon)
+{
+	int flags;
+	char *s, *t;
+	char buf[PATH_MAX];
+
+	t = icon->patt;
+	if (t == NULL)
+		return false;
+	if (!checkmode(icon, entry))
+		return false;
+	if (t[0] == '~' || strchr(t, '/') != NULL) {
+		flags = FNM_CASEFOLD | FNM_PATHNAME;
+		s = fullpath(buf, path, entry->name);
+	} else {
+		flags = FNM_CASEFOLD;
+		s = entry->name;
+	}
+	if (t[0] == '~') {
+		if (strncmp(fm->home, s, fm->homelen) != 0)
+			return false;
+		t++;
+		s += fm->homelen;
+	}
+	return fnmatch(t, s, flags) == 0;
+}
+
+static size_t
+hashlit(const char *s, size_t len)
+{
+	size_t i, h;
+
+	/* FNV-1a */
+	h = 2166136261u;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static bool
+foldname(struct IconMatcher *m, const char *name, char *buf, size_t *len)
+{
+	size_t i;
+
+	/*
+	 * Fold the case of name into buf, the way fnmatch(3) does with
+	 * FNM_CASEFOLD.  Fail on names with non-ASCII characters, whose
+	 * folding depends on the locale; those are matched by fnmatch(3).
+	 */
+	for (i = 0; name[i] != '\0'; i++) {
+		if (i >= NAME_MAX || (unsigned char)name[i] >= 128)
+			return false;
+		buf[i] = m->fold[(unsigned char)name[i]];
+	}
+	buf[i] = '\0';
+	*len = i;
+	return true;
+}
+
+static struct IconRule *
+lookuprule(struct IconMatcher *m, struct IconRule **table, const char *s, size_t len, Item *entry)
+{
+	struct IconRule *rule;
+
+	/* rules in a bucket are in order, so the first match is the best one */
+	for (rule = table[hashlit(s, len) & (m->nbuckets - 1)]; rule != NULL; rule = rule->next)
+		if (rule->len == len && memcmp(rule->lit, s, len) == 0 && checkmode(rule->patt, entry))
+			return rule;
+	return NULL;
+}
+
+static bool
+checkrule(struct FM *fm, const char *path, Item *entry, struct IconRule *rule, const char *name, size_t len)
+{
+	switch (rule->shape) {
+	case SHAPE_ANY:
+		return checkmode(rule->patt, entry);
+	case SHAPE_PREFIX:
+		return len >= rule->len &&
+		       memcmp(name, rule->lit, rule->len) == 0 &&
+		       checkmode(rule->patt, entry);
+	case SHAPE_SUFFIX:
+		return len >= rule->len &&
+		       memcmp(name + len - rule->len, rule->lit, rule->len) == 0 &&
+		       checkmode(rule->patt, entry);
+	default:
+		return checkicon(fm, path, entry, rule->patt);
+	}
+}
+
+static struct IconRule *
+scanrules(struct FM *fm, const char *path, Item *entry, struct IconRule **rules, size_t nrules, struct IconRule *best, const char *name, size_t len)
+{
+	size_t i;
+
+	/* return the first rule that matches and comes before best */
+	for (i = 0; i < nrules; i++) {
+		if (best != NULL && rules[i] > best)
+			break;
+		if (checkrule(fm, path, entry, rules[i], name, len))
+			return rules[i];
+	}
+	return NULL;
+}
+
+static struct IconRule *
+extrule(struct FM *fm, const char *path, Item *entry, const char *name, size_t len, const char *ext)
+{
+	struct IconMatcher *m;
+	struct IconCache *cache;
+	struct IconRule *best, *rule;
+	size_t extlen;
+
+	m = &fm->icons;
+	extlen = len - (ext - name);
+	cache = NULL;
+	if (extlen < ICONEXTSIZE) {
+		cache = &m->cache[(hashlit(ext, extlen) * 31 + entry->mode) % ICONCACHESIZE];
+		etlock(&m->lock);
+		if (cache->valid && cache->mode == entry->mode &&
+		    memcmp(cache->ext, ext, extlen + 1) == 0) {
+			best = cache->rule;
+#ifdef DEBUG
+			m->hits++;
+#endif
+			etunlock(&m->lock);
+			return best;
+		}
+#ifdef DEBUG
+		m->misses++;
+#endif
+		etunlock(&m->lock);
+	}
+	best = lookuprule(m, m->exts, ext, extlen, entry);
+	rule = scanrules(fm, path, entry, m->extrules, m->nextrules, best, name, len);
+	if (rule != NULL)
+		best = rule;
+	if (cache != NULL) {
+		etlock(&m->lock);
+		memcpy(cache->ext, ext, extlen + 1);
+		cache->mode = entry->mode;
+		cache->rule = best;
+		cache->valid = true;
+		etunlock(&m->lock);
+	}
+	return best;
+}
+
+static size_t
+geticon(struct FM *fm, const char *path, Item *entry)
+{
+	struct IconMatcher *m;
+	struct IconRule *rule, *best;
+	size_t i, len;
+	char *ext;
+	char name[NAME_MAX + 1];
+
+	/* parent directory is a special case */
+	if (strcmp(entry->name, "..") == 0)
+		return icon_for_updir;
+	m = &fm->icons;
+	if (m->rules == NULL || !foldname(m, entry->name, name, &len)) {
+		/* first check user-defined matches */
+		for (i = 0; i < fm->nuserpatts; i++)
+			if (checkicon(fm, path, entry, &fm->userpatts[i]))
+				return fm->userpatts[i].index;
+		/* then check hardcoded icon matches */
+		for (i = 0; i < nicon_patts; i++)
+			if (checkicon(fm, path, entry, &icon_patts[i]))
+				return icon_patts[i].index;
+		goto done;
+	}
+
+	/*
+	 * Find the first rule matching by extension (which is likely
+	 * to have been found for a previous entry), then the first rule
+	 * matching by name or path, if any, that comes before it.
+	 */
+	if ((ext = strrchr(name, '.')) != NULL)
+		best = extrule(fm, path, entry, name, len, ext + 1);
+	else
+		best = scanrules(fm, path, entry, m->extrules, m->nextrules, NULL, name, len);
+	rule = lookuprule(m, m->names, name, len, entry);
+	if (rule != NULL && (best == NULL || rule < best))
+		best = rule;
+	rule = scanrules(fm, path, entry, m->others, m->nothers, best, name, len);
+	if (rule != NULL)
+		best = rule;
+	if (best != NULL)
+		return best->patt->index;
+done:
+	/* just return directory or regular file then */
+	if (isdir(entry))
+		return icon_for_dir;
+	return icon_for_file;
+}
+
+static int
+pollthumb(struct FM *fm, pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	struct pollfd pfd;
+	struct timespec now, deadline;
+	int fd, n, timeout;
+
+	/*
+	 * Block until the thumbnailer exits or the timeout expires, on
+	 * a descriptor referring to it, which becomes readable when it
+	 * exits.  Return whether it has exited, or -1 if we cannot tell.
+	 */
+	if ((fd = syscall(SYS_pidfd_open, pid, 0)) == -1)
+		return -1;
+	(void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += fm->thumbtimeout;
+	pfd = (struct pollfd){ .fd = fd, .events = POLLIN };
+	do {
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = max(0, (deadline.tv_sec - now.tv_sec) * 1000 +
+		                 (deadline.tv_nsec - now.tv_nsec) / 1000000);
+	} while ((n = poll(&pfd, 1, timeout)) == -1 && errno == EINTR);
+	(void)close(fd);
+	return n;
+#else
+	(void)fm;
+	(void)pid;
+	return -1;
+#endif
+}
+
+static int
+waitthumb(struct FM *fm, pid_t pid, char *orig)
+{
+	struct timespec ts;
+	pid_t ret;
+	long waited;
+	int delay, status;
+
+	/*
+	 * Wait for the thumbnailer; if it takes too long, kill it and
+	 * whatever it has run (they are in its process group).
+	 *
+	 * With no timeout we just block on waitpid(2); otherwise we
+	 * block on poll(2) up to the timeout (see pollthumb()).  Where
+	 * the thumbnailer cannot be polled, check for it at increasing
+	 * intervals instead.
+	 */
+	if (fm->thumbtimeout == 0)
+		goto reap;
+	switch (pollthumb(fm, pid)) {
+	case 0:
+		goto timedout;
+	case 1:
+		goto reap;
+	}
+	waited = 0;
+	delay = 1;
+	while ((ret = waitpid(pid, &status, WNOHANG)) != pid) {
+		if (ret == -1 && errno != EINTR)
+			return THUMB_ABORTED;
+		if (waited >= fm->thumbtimeout * 1000L)
+			goto timedout;
+		ts.tv_sec = 0;
+		ts.tv_nsec = delay * 1000000L;
+		(void)nanosleep(&ts, NULL);
+		waited += delay;
+		delay = min(delay * 2, THUMBPOLLMAX);
+	}
+	goto done;
+reap:
+	while ((ret = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+		;
+	if (ret == -1)
+		return THUMB_ABORTED;
+done:
+	/* 127 is for a thumbnailer, or a command it needs, not found */
+	if (!WIFEXITED(status) || WEXITSTATUS(status) == NOTFOUND)
+		return THUMB_ABORTED;
+	return WEXITSTATUS(status) == 0 ? THUMB_CREATED : THUMB_FAILED;
+timedout:
+	warnx("%s: thumbnailer timed out", orig);
+	(void)kill(-pid, SIGKILL);
+	(void)kill(pid, SIGKILL);
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	return THUMB_ABORTED;
+}
+
+static void
+coprocclose(struct Coproc *cp, bool force)
+{
+	int status;
+
+	/*
+	 * The coprocess exits when it reads end of file; unless it is
+	 * stuck, then kill it and whatever it has run.
+	 */
+	if (cp->pid == -1)
+		return;
+	if (force) {
+		(void)kill(-cp->pid, SIGKILL);
+		(void)kill(cp->pid, SIGKILL);
+	}
+	(void)close(cp->fd);
+	while (waitpid(cp->pid, &status, 0) == -1 && errno == EINTR)
+		;
+	cp->pid = -1;
+	cp->fd = -1;
+	cp->len = 0;
+}
+
+static int
+coprocopen(struct Coproc *cp)
+{
+	int sv[2];
+	pid_t pid;
+
+	/* the socket must not leak into other coprocesses, or they would not get EOF */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		warn("socketpair");
+		return RETURN_FAILURE;
+	}
+	if ((pid = efork()) == 0) {
+		/* child; in a group of its own, so it can be killed with what it runs */
+		(void)setpgid(0, 0);
+		if (dup2(sv[1], STDIN_FILENO) == -1 || dup2(sv[1], STDOUT_FILENO) == -1)
+			err(EXIT_FAILURE, "dup2");
+		eexec((char *[]){
+			THUMBNAILERCMD,
+			"-l",
+			NULL,
+		});
+	}
+	(void)close(sv[1]);
+	cp->pid = pid;
+	cp->fd = sv[0];
+	cp->len = 0;
+	return RETURN_SUCCESS;
+}
+
+static int
+coprocthumb(struct FM *fm, struct Coproc *cp, char *orig, char *thumb)
+{
+	struct pollfd pfd;
+	struct timespec now, deadline;
+	ssize_t n;
+	size_t len, off;
+	int timeout, ret;
+	char *nl;
+	char buf[PATH_MAX * 2 + 16];
+
+	/*
+	 * Have the coprocess create the thumbnail.  Return whether it
+	 * could, or THUMB_FORK if the caller has to run a thumbnailer
+	 * instead (paths with newlines cannot be sent; and a coprocess
+	 * that exits without replying is not run again, as it may not
+	 * know the loop mode).
+	 */
+	if (cp->failed || strchr(orig, '\n') != NULL || strchr(thumb, '\n') != NULL)
+		return THUMB_FORK;
+	if (cp->pid == -1 && coprocopen(cp) == RETURN_FAILURE)
+		goto failed;
+	len = snprintf(buf, sizeof(buf), "%s\n%s\n%d\n", orig, thumb, THUMBSIZE);
+	for (off = 0; off < len; off += n) {
+		if ((n = send(cp->fd, buf + off, len - off, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			goto failed;
+		}
+	}
+
+	/*
+	 * Read until there is a whole line; a read can return less than
+	 * a line, or more (the coprocess may write ahead), so what comes
+	 * after the line is kept for the next reply.
+	 */
+	(void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += fm->thumbtimeout;
+	pfd = (struct pollfd){ .fd = cp->fd, .events = POLLIN };
+	while ((nl = memchr(cp->reply, '\n', cp->len)) == NULL) {
+		if (cp->len == sizeof(cp->reply))
+			goto failed;
+		timeout = -1;
+		if (fm->thumbtimeout > 0) {
+			(void)clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = max(0, (deadline.tv_sec - now.tv_sec) * 1000 +
+			                 (deadline.tv_nsec - now.tv_nsec) / 1000000);
+		}
+		switch (poll(&pfd, 1, timeout)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			goto failed;
+		case 0:
+			warnx("%s: thumbnailer timed out", orig);
+			coprocclose(cp, true);
+			return THUMB_ABORTED;
+		}
+		if ((n = read(cp->fd, cp->reply + cp->len, sizeof(cp->reply) - cp->len)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			goto failed;
+		}
+		cp->len += n;
+	}
+	len = nl - cp->reply + 1;
+	if (len >= 3 && strncmp(cp->reply, "ok", 2) == 0 &&
+	    (cp->reply[2] == ' ' || cp->reply[2] == '\n'))
+		ret = THUMB_CREATED;
+	else if (len == 5 && strncmp(cp->reply, "fail\n", 5) == 0)
+		ret = THUMB_FAILED;
+	else
+		ret = THUMB_ABORTED;
+	cp->len -= len;
+	memmove(cp->reply, cp->reply + len, cp->len);
+	return ret;
+failed:
+	coprocclose(cp, true);
+	cp->failed = true;
+	return THUMB_FORK;
+}
+
+static void
+thumbfailed(char *mime)
+{
+	int fd;
+
+	/*
+	 * Leave an empty thumbnail, so the file is not thumbnailed again
+	 * until it changes; see thumbexists().  It is not an error if it
+	 * cannot be left, the file is just thumbnailed again next time.
+	 */
+	if ((fd = open(mime, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1)
+		(void)close(fd);
+}
+
+static int
+thumbexists(struct FM *fm, struct Coproc *cp, struct ThumbDir *dir, Item *entry, char *orig, char *mime)
+{
+	struct stat sb;
+	struct timespec origt, mimet;
+	off_t size;
+	int ret;
+
+	/*
+	 * A thumbnail newer than its file is up to date; an empty one
+	 * records that the thumbnailer could not create it, and that
+	 * it would fail again for the same file.
+	 */
+	if (stat(mime, &sb) == -1)
+		goto forkthumbnailer;
+	mimet = sb.st_mtim;
+	size = sb.st_size;
+	if (dir == NULL || fstatat(dir->fd, entry->name, &sb, 0) == -1)
+		goto forkthumbnailer;
+	origt = sb.st_mtim;
+	if (timespeclt(&origt, &mimet))
+		return size > 0;
+forkthumbnailer:
+	if ((ret = coprocthumb(fm, cp, orig, mime)) == THUMB_FORK)
+		ret = waitthumb(fm, forkthumb(orig, mime), orig);
+	if (ret == THUMB_FAILED)
+		thumbfailed(mime);
+	return ret == THUMB_CREATED;
+}
+
+static void *
+thumbnailer(void *arg)
+{
+	struct FM *fm;
+	struct Coproc cp;
+	struct ThumbJob job;
+	Item entry;
+	int i, ret;
+	char orig[PATH_MAX];
+	char path[PATH_MAX];
+
+	fm = (struct FM *)arg;
+	cp = (struct Coproc){
+		.pid = -1,
+		.fd = -1,
+		.failed = !fm->thumbcoproc,
+	};
+	while (thumbtake(fm, &job, &entry, orig) >= 0) {
+		ret = strncmp(orig, fm->thumbnaildir, fm->thumbnaildirlen) != 0 &&
+		      setthumbpath(fm, &entry, orig, path) == RETURN_SUCCESS &&
+		      thumbexists(fm, &cp, job.dir, &entry, orig, path);
+		etlock(&fm->thumbdrawlock);
+		if ((i = thumbfinish(fm, &job)) >= 0 && ret)
+			widget_thumb(fm->widget, path, i);
+		etunlock(&fm->thumbdrawlock);
+	}
+	coprocclose(&cp, false);
+	pthread_exit(0);
+}
+
+static void
+closethumbthread(struct FM *fm)
+{
+	/*
+	 * Wait for the thumbnailer threads to exit; they exit after
+	 * the thumbnail they are creating, if any.
+	 */
+	etlock(&fm->thumblock);
+	fm->thumbexit = 1;
+	while (fm->nthumbthreads > 0)
+		etwait(&fm->thumbcond, &fm->thumblock);
+	fm->thumbexit = 0;
+	etunlock(&fm->thumblock);
+}
+
+static void
+createthumbthread(struct FM *fm)
+{
+	pthread_t tid;
+	int n;
+
+	/*
+	 * Entries read from the metadata cache are thumbnailed once they
+	 * have been revalidated; see revalidatetake().  Entries being
+	 * read are thumbnailed once all of them are; see loadtake().
+	 */
+	if (fm->thumbnaildir == NULL || fm->reval.running || fm->load.running)
+		return;
+
+	/*
+	 * The threads still running take the new entries.  Those busy
+	 * with stale entries may be so for up to thumbtimeout seconds,
+	 * so the pool is filled up without them; no more threads than
+	 * entries left to be thumbnailed.
+	 */
+	etlock(&fm->thumblock);
+	n = min(fm->nthumbjobs, fm->nthumbpending);
+	for (; fm->nthumbthreads - fm->nthumbstale < n; fm->nthumbthreads++) {
+		etcreate(&tid, thumbnailer, (void *)fm);
+		etdetach(tid);
+	}
+	etunlock(&fm->thumblock);
+}
+
+static void
+thumbsetdir(struct FM *fm, int fd)
+{
+	struct ThumbDir *td;
+
+	/*
+	 * We are opening another directory.  Stop thumbnailing the
+	 * entries in the view, and drop the thumbnails being created
+	 * for them, rather than wait for the thumbnailers; the entries
+	 * of the new directory are thumbnailed relative to a descriptor
+	 * of their own, for fm->dirfd to be closed as we leave.
+	 */
+	td = NULL;
+	if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		warn("fcntl");
+	} else {
+		td = emalloc(sizeof(*td));
+		td->fd = fd;
+		td->refs = 1;
+	}
+	etlock(&fm->thumbdrawlock);
+	etlock(&fm->thumblock);
+	thumbdirdrop(fm->thumbdir);
+	fm->thumbdir = td;
+	if (fm->thumbpending != NULL)
+		memset(fm->thumbpending, PENDING_NO, fm->nview);
+	fm->nthumbpending = 0;
+	thumbremap(fm, NULL);
+	etunlock(&fm->thumblock);
+	etunlock(&fm->thumbdrawlock);
+}
+
+static unsigned char
+filemode(struct FM *fm, int dirfd, struct stat *sb, char *name)
+{
+	bool ismember;
+	struct stat lsb;
+	size_t perm_off;
+	unsigned char mask, type;
+	int i;
+
+	mask = 0x00;
+	if (S_ISLNK(sb->st_mode)) {
+		mask |= MODE_LINK;
+		if (fstatat(dirfd, name, &lsb, 0) == -1) {
+			type = MODE_BROK;
+			goto done;
+		}
+		sb = &lsb;
+	}
+	switch (sb->st_mode & S_IFMT) {
+	case S_IFBLK:   type = MODE_DEV;     break;
+	case S_IFCHR:   type = MODE_DEV;     break;
+	case S_IFDIR:   type = MODE_DIR;     break;
+	case S_IFIFO:   type = MODE_FIFO;    break;
+	case S_IFSOCK:  type = MODE_SOCK;    break;
+	default:        type = MODE_FILE;    break;
+	}
+done:
+	ismember = false;
+	for (i = 0; i < fm->ngrps; i++) {
+		if (fm->grps[i] == sb->st_gid) {
+			ismember = true;
+			break;
+		}
+	}
+	if (sb->st_uid == fm->uid)
+		perm_off = 0;
+	else if (sb->st_gid == fm->gid || ismember)
+		perm_off = 3;
+	else
+		perm_off = 6;
+	if (sb->st_mode & (S_IRUSR >> perm_off))
+		mask |= MODE_READ;
+	if (sb->st_mode & (S_IWUSR >> perm_off))
+		mask |= MODE_WRITE;
+	if (sb->st_mode & (S_IXUSR >> perm_off))
+		mask |= MODE_EXEC;
+	return type | mask;
+}
+
+static int
+diropen(struct FM *fm, struct Cwd *cwd, const char *path)
+{
+	struct stat sb;
+	int fd;
+	char buf[PATH_MAX];
+
+	/*
+	 * Entries are stat(2)ed relative to an open descriptor of their
+	 * directory, rather than by their full path; so the kernel does
+	 * not walk the whole path again for each entry.  We still change
+	 * into the directory, for the commands we spawn to run there.
+	 */
+	if (path == NULL)
+		path = ".";
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		warn("%s", path);
+		return RETURN_FAILURE;
+	}
+	if (fchdir(fd) == -1) {
+		warn("%s", path);
+		(void)close(fd);
+		return RETURN_FAILURE;
+	}
+	if (fstat(fd, &sb) == -1)
+		err(EXIT_FAILURE, "fstat");
+	thumbsetdir(fm, fd);
+	if (fm->dirfd != -1)
+		(void)close(fm->dirfd);
+	fm->dirfd = fd;
+	free(cwd->path);
+	free(cwd->here);
+	egetcwd(buf, sizeof(buf));
+	cwd->path = estrdup(buf);
+	fm->time = sb.st_ctim;
+	if (strstr(cwd->path, fm->home) == cwd->path &&
+	    (cwd->path[fm->homelen] == '/' || cwd->path[fm->homelen] == '\0')) {
+		snprintf(buf, PATH_MAX, "~%s", cwd->path + fm->homelen);
+	} else {
+		snprintf(buf, PATH_MAX, "%s", cwd->path);
+	}
+	cwd->here = estrdup(buf);
+	return RETURN_SUCCESS;
+}
+
+static void *
+statworker(void *arg)
+{
+	struct StatJob *job;
+	int i, n;
+
+	job = (struct StatJob *)arg;
+	for (;;) {
+		etlock(&job->lock);
+		i = job->next;
+		job->next += STATCHUNK;
+		etunlock(&job->lock);
+		if (i >= job->nentries)
+			break;
+		n = min(i + STATCHUNK, job->nentries);
+		for (; i < n; i++) {
+			if (fstatat(job->dirfd, job->entries[i].name,
+			            &job->stats[i].sb, AT_SYMLINK_NOFOLLOW) == -1) {
+				job->stats[i].errnum = errno;
+				job->entries[i].mode = 0;
+			} else {
+				job->stats[i].errnum = 0;
+				job->entries[i].mode = filemode(
+					job->fm,
+					job->dirfd,
+					&job->stats[i].sb,
+					job->entries[i].name
+				);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+statentries(struct FM *fm, int dirfd, Item *entries, struct EntryStat *stats, int nentries, int maxthreads)
+{
+	pthread_t tids[NSTATTHREADS - 1];
+	int i, nthreads;
+	struct StatJob job = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.fm = fm,
+		.dirfd = dirfd,
+		.entries = entries,
+		.stats = stats,
+		.next = 0,
+		.nentries = nentries,
+	};
+
+	/*
+	 * Most of the time spent opening a directory on a network file
+	 * system (or on a cold cache) is waiting for each stat(2) round
+	 * trip.  Issue them from a few threads at once, each one taking
+	 * chunks of entries from a shared counter, so a slow entry does
+	 * not hold the entries after it.
+	 *
+	 * The calling thread works as one of the workers.
+	 */
+	nthreads = min(min(maxthreads, NSTATTHREADS), (nentries + STATCHUNK - 1) / STATCHUNK);
+	for (i = 0; i < nthreads - 1; i++)
+		etcreate(&tids[i], statworker, &job);
+	(void)statworker(&job);
+	for (i = 0; i < nthreads - 1; i++)
+		etjoin(tids[i], NULL);
+}
+
+static void
+fillentries(struct FM *fm, struct Dir *dir, int dirfd, const char *path, int first, int maxthreads)
+{
+	struct EntryStat *stats;
+	Item *entry;
+	int i, n;
+
+	n = dir->nentries - first;
+	if (n <= 0)
+		return;
+	stats = emalloc(n * sizeof(*stats));
+	statentries(fm, dirfd, dir->entries + first, stats, n, maxthreads);
+	for (i = 0; i < n; i++) {
+		entry = &dir->entries[first + i];
+		if (stats[i].errnum != 0) {
+			errno = stats[i].errnum;
+			warn("%s", entry->name);
+			entry->size = 0;
+			entry->mtime = 0;
+			entry->uid = 0;
+			entry->gid = 0;
+		} else {
+			entry->size = stats[i].sb.st_size;
+			entry->mtime = stats[i].sb.st_mtim.tv_sec;
+			entry->uid = stats[i].sb.st_uid;
+			entry->gid = stats[i].sb.st_gid;
+		}
+		entry->icon = geticon(fm, path, entry);
+	}
+	free(stats);
+}
+
+static void
+setsortkey(struct Dir *dir, int index)
+{
+	struct SortKey *key;
+	Item *entry;
+	uint64_t rank;
+	size_t i, len;
+	char buf[KEYBUFSIZE];
+	char *xfrm;
+
+	/*
+	 * Entries are sorted with dotdot (parent directory) first, then
+	 * directories, then dotentries (hidden entries), and then by
+	 * their names, as strcoll(3) sorts them.
+	 *
+	 * The rank and the collation key are computed once per entry.
+	 * The rank and the first bytes of the key are packed into an
+	 * integer, so most comparisons are between two integers; only
+	 * the ones between equal prefixes must compare the whole keys
+	 * with strcmp(3), which gives the same order strcoll(3) gives
+	 * on the names.
+	 *
+	 * The collation keys can take several times the memory of the
+	 * names; so a huge directory does not keep them.  The key of each
+	 * entry is only computed for the prefix, and the comparisons
+	 * between equal prefixes call strcoll(3) on the names instead.
+	 */
+	key = &dir->keys[index];
+	entry = &dir->entries[index];
+	rank = 0x0;
+	if (strcmp(entry->name, "..") != 0)
+		rank |= 0x4;
+	if (!isdir(entry))
+		rank |= 0x2;
+	if (entry->name[0] != '.')
+		rank |= 0x1;
+	len = strxfrm(NULL, entry->name, 0);
+	if (!dir->huge)
+		xfrm = arenaalloc(&dir->keyarena, len + 1);
+	else if (len < sizeof(buf))
+		xfrm = buf;
+	else
+		xfrm = emalloc(len + 1);
+	(void)strxfrm(xfrm, entry->name, len + 1);
+	key->prefix = rank << KEYRANKSHIFT;
+	for (i = 0; i < len && i < KEYRANKSHIFT / 8; i++)
+		key->prefix |= (uint64_t)(unsigned char)xfrm[i] << (KEYRANKSHIFT - 8 * (i + 1));
+	key->index = index;
+	key->isname = dir->huge;
+	if (!dir->huge) {
+		key->key = xfrm;
+	} else {
+		key->key = entry->name;
+		if (xfrm != buf) {
+			free(xfrm);
+		}
+	}
+}
+
+static void
+dropkeys(struct Dir *dir, int nsorted)
+{
+	int i;
+
+	/* the directory has grown huge; compare the names from now on */
+	for (i = 0; i < nsorted; i++) {
+		dir->keys[i].key = dir->entries[dir->keys[i].index].name;
+		dir->keys[i].isname = true;
+	}
+	arenafree(&dir->keyarena);
+	dir->huge = true;
+}
+
+static int
+keycmp(const void *ap, const void *bp)
+{
+	struct SortKey *a, *b;
+
+	a = (struct SortKey *)ap;
+	b = (struct SortKey *)bp;
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+	if (a->isname)
+		return strcoll(a->key, b->key);
+	return strcmp(a->key, b->key);
+}
+
+static void
+radixsort(struct SortKey *keys, struct SortKey *tmp, int n)
+{
+	struct SortKey *src, *dst, *swp;
+	size_t count[256];
+	size_t off, c;
+	int shift, i, j;
+
+	if (n < RADIXMIN) {
+		qsort(keys, n, sizeof(*keys), keycmp);
+		return;
+	}
+
+	/*
+	 * Least-significant-digit radix sort on the prefixes, one byte
+	 * at a time; the passes on bytes every key has equal (like the
+	 * rank on a directory with no subdirectories) are skipped.
+	 */
+	src = keys;
+	dst = tmp;
+	for (shift = 0; shift < 64; shift += 8) {
+		(void)memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(src[i].prefix >> shift) & 0xFF]++;
+		if (count[(src[0].prefix >> shift) & 0xFF] == (size_t)n)
+			continue;
+		for (off = 0, i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = off;
+			off += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[(src[i].prefix >> shift) & 0xFF]++] = src[i];
+		swp = src;
+		src = dst;
+		dst = swp;
+	}
+	if (src != keys)
+		(void)memcpy(keys, src, n * sizeof(*keys));
+
+	/* break the ties between keys with the same prefix */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && keys[j].prefix == keys[i].prefix; j++)
+			;
+		if (j - i > 1) {
+			qsort(keys + i, j - i, sizeof(*keys), keycmp);
+		}
+	}
+}
+
+static void
+sortentries(struct Dir *dir, struct SortKey *keytmp, Item *tmp, int nsorted, int *order)
+{
+	int i, j, k;
+
+	/*
+	 * Entries [0, nsorted) are already sorted.  Sort the keys of the
+	 * entries read after them, merge both runs of keys into keytmp,
+	 * and then move the entries into the order of the keys.
+	 *
+	 * If order is not NULL, it is filled with the index each entry
+	 * had before being sorted.
+	 */
+	if (!dir->huge && dir->nentries >= HUGEDIR)
+		dropkeys(dir, nsorted);
+	for (i = nsorted; i < dir->nentries; i++)
+		setsortkey(dir, i);
+	radixsort(dir->keys + nsorted, keytmp, dir->nentries - nsorted);
+	i = 0;
+	j = nsorted;
+	for (k = 0; i < nsorted && j < dir->nentries; k++) {
+		if (keycmp(&dir->keys[j], &dir->keys[i]) < 0)
+			keytmp[k] = dir->keys[j++];
+		else
+			keytmp[k] = dir->keys[i++];
+	}
+	while (i < nsorted)
+		keytmp[k++] = dir->keys[i++];
+	while (j < dir->nentries)
+		keytmp[k++] = dir->keys[j++];
+	for (k = 0; k < dir->nentries; k++) {
+		if (order != NULL)
+			order[k] = keytmp[k].index;
+		tmp[k] = dir->entries[keytmp[k].index];
+		keytmp[k].index = k;
+	}
+	(void)memcpy(dir->entries, tmp, dir->nentries * sizeof(*tmp));
+	(void)memcpy(dir->keys, keytmp, dir->nentries * sizeof(*keytmp));
+}
+
+static void
+growentries(struct Dir *dir)
+{
+	if (dir->nentries < dir->capacity)
+		return;
+	dir->capacity = dir->capacity > 0 ? dir->capacity * 2 : INCRSIZE;
+	dir->entries = erealloc(dir->entries, dir->capacity * sizeof(*dir->entries));
+	dir->keys = erealloc(dir->keys, dir->capacity * sizeof(*dir->keys));
+}
+
+static void
+resetdir(struct Dir *dir)
+{
+	arenareset(&dir->arena);
+	arenareset(&dir->keyarena);
+	dir->nentries = 0;
+	dir->huge = false;
+}
+
+static void
+freedir(struct Dir *dir)
+{
+	arenafree(&dir->arena);
+	arenafree(&dir->keyarena);
+	free(dir->entries);
+	free(dir->keys);
+	*dir = (struct Dir){ 0 };
+}
+
+static void
+setview(struct FM *fm)
+{
+	int i;
+
+	/*
+	 * The widget is given a copy of the entries that are not hidden;
+	 * so hiding or showing dotentries is a pass over the entries we
+	 * have, rather than reading the directory again.
+	 *
+	 * When no entry is hidden, the widget is given the entries
+	 * themselves, rather than a copy of them.  The entries are then
+	 * changed under the widget; so they must only be changed right
+	 * before giving them to the widget again.
+	 */
+	fm->viewmap = erealloc(fm->viewmap, max(fm->dir.capacity, 1) * sizeof(*fm->viewmap));
+	/* the widget fills the selection up to the number of entries */
+	fm->selitems = erealloc(fm->selitems, max(fm->dir.capacity, 1) * sizeof(*fm->selitems));
+	fm->nview = 0;
+	for (i = 0; i < fm->dir.nentries; i++)
+		if (!direnthidden(fm->dir.entries[i].name))
+			fm->viewmap[fm->nview++] = i;
+	if (fm->nview == fm->dir.nentries) {
+		free(fm->viewbuf);
+		fm->viewbuf = NULL;
+		fm->view = fm->dir.entries;
+		return;
+	}
+	fm->viewbuf = erealloc(fm->viewbuf, max(fm->nview, 1) * sizeof(*fm->viewbuf));
+	for (i = 0; i < fm->nview; i++)
+		fm->viewbuf[i] = fm->dir.entries[fm->viewmap[i]];
+	fm->view = fm->viewbuf;
+}
+
+static int
+setwidget(struct FM *fm, Scroll *scrl)
+{
+	/*
+	 * Give the widget all the entries, to be thumbnailed again.
+	 * The caller must hold fm->thumbdrawlock, for no thumbnail to
+	 * be given to the widget under the old view.
+	 */
+	etlock(&fm->thumblock);
+	setview(fm);
+	fm->thumbpending = erealloc(fm->thumbpending, max(fm->nview, 1));
+	memset(fm->thumbpending, PENDING_YES, fm->nview);
+	fm->nthumbpending = fm->nview;
+	thumbremap(fm, NULL);
+	etunlock(&fm->thumblock);
+	return widget_set(
+		fm->widget,
+		fm->cwd->path,
+		fm->cwd->here,
+		fm->view,
+		fm->nview,
+		scrl
+	);
+}
+
+static int
+setentries(struct FM *fm, Scroll *scrl)
+{
+	int retval;
+
+	etlock(&fm->thumbdrawlock);
+	retval = setwidget(fm, scrl);
+	etunlock(&fm->thumbdrawlock);
+	return retval;
+}
+
+static void
+updateview(struct FM *fm, const int *newindex, const int *renew, int nrenew, Scroll *scrl)
+{
+	int *oldmap, *dirtoview, *viewindex;
+	int i, j, k, nold;
+	char *pending;
+
+	/*
+	 * The entries have changed; newindex[i] is the new index in
+	 * fm->dir.entries of the entry that was at i, or -1 if it is gone
+	 * (a NULL newindex means the entries have not moved).  Build the
+	 * view again, and give the widget the map from the old view into
+	 * the new one, for it to keep the state of the entries.
+	 *
+	 * The entries left to be thumbnailed are those that were left
+	 * before, those that were not in the view, and those in renew[].
+	 * The thumbnailers are left running; the entries being
+	 * thumbnailed are moved to their new indices (see thumbremap()),
+	 * and no thumbnail is given to the widget under the old view.
+	 *
+	 * See widget_update() for scrl.
+	 */
+	etlock(&fm->thumbdrawlock);
+	etlock(&fm->thumblock);
+	oldmap = fm->viewmap;
+	nold = fm->nview;
+	fm->viewmap = NULL;
+	setview(fm);
+	dirtoview = emalloc(max(fm->dir.nentries, 1) * sizeof(*dirtoview));
+	viewindex = emalloc(max(nold, 1) * sizeof(*viewindex));
+	pending = emalloc(max(fm->nview, 1));
+	for (i = 0; i < fm->dir.nentries; i++)
+		dirtoview[i] = -1;
+	for (i = 0; i < fm->nview; i++) {
+		dirtoview[fm->viewmap[i]] = i;
+		pending[i] = PENDING_YES;
+	}
+	for (i = 0; i < nold; i++) {
+		k = (newindex != NULL) ? newindex[oldmap[i]] : oldmap[i];
+		viewindex[i] = (k < 0) ? -1 : dirtoview[k];
+		if (viewindex[i] >= 0) {
+			pending[viewindex[i]] = PENDING_NO;
+		}
+	}
+	for (i = 0; fm->thumbpending != NULL && i < nold; i++)
+		if (fm->thumbpending[i] == PENDING_YES && viewindex[i] >= 0)
+			pending[viewindex[i]] = PENDING_YES;
+	free(fm->thumbpending);
+	fm->thumbpending = pending;
+	thumbremap(fm, viewindex);
+	for (j = 0; j < nrenew; j++)
+		if (dirtoview[renew[j]] >= 0)
+			pending[dirtoview[renew[j]]] = PENDING_YES;
+	fm->nthumbpending = 0;
+	for (i = 0; i < fm->nview; i++)
+		if (pending[i] == PENDING_YES)
+			fm->nthumbpending++;
+	etunlock(&fm->thumblock);
+	if (widget_update(fm->widget, fm->view, fm->nview, viewindex, nold, scrl) == RETURN_FAILURE)
+		(void)setwidget(fm, (scrl != NULL) ? scrl : &fm->cwd->scrl);
+	etunlock(&fm->thumbdrawlock);
+	free(oldmap);
+	free(dirtoview);
+	free(viewindex);
+}
+
+static void
+filterentries(struct FM *fm)
+{
+	/* dotentries have been hidden or shown */
+	updateview(fm, NULL, NULL, 0, NULL);
+	createthumbthread(fm);
+}
+
+static int
+namecmp(const void *ap, const void *bp)
+{
+	struct WatchName *a, *b;
+
+	a = (struct WatchName *)ap;
+	b = (struct WatchName *)bp;
+	return strcmp(a->name, b->name);
+}
+
+static void *
+revalidator(void *arg)
+{
+	struct FM *fm;
+	struct Revalidate *rv;
+	struct Dir view;
+	bool cancel;
+	int first;
+
+	fm = (struct FM *)arg;
+	rv = &fm->reval;
+	for (first = 0; first < rv->dir.nentries; first = view.nentries) {
+		etlock(&rv->lock);
+		cancel = rv->cancel;
+		etunlock(&rv->lock);
+		if (cancel)
+			return NULL;
+		view = (struct Dir){
+			.entries = rv->dir.entries,
+			.nentries = min(first + REVALBATCH, rv->dir.nentries),
+		};
+		fillentries(fm, &view, rv->dirfd, rv->path, first, NSTATTHREADS);
+	}
+	etlock(&rv->lock);
+	rv->done = true;
+	etunlock(&rv->lock);
+	widget_wakeup(fm->widget);
+	return NULL;
+}
+
+static void
+revalidate(struct FM *fm)
+{
+	struct Revalidate *rv;
+	int i;
+
+	/*
+	 * Copy the names of the entries for the revalidator thread; the
+	 * entries themselves can be updated by inotify(7) events while
+	 * the thread runs.  The results are merged back by name.
+	 */
+	rv = &fm->reval;
+	if ((rv->dirfd = fcntl(fm->dirfd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		warn("fcntl");
+		return;
+	}
+	rv->path = estrdup(fm->cwd->path);
+	for (i = 0; i < fm->dir.nentries; i++) {
+		growentries(&rv->dir);
+		rv->dir.entries[rv->dir.nentries++] = (Item){
+			.name = arenastrdup(&rv->dir.arena, fm->dir.entries[i].name),
+		};
+	}
+	rv->cancel = false;
+	rv->done = false;
+	rv->running = true;
+	etcreate(&rv->thread, revalidator, fm);
+}
+
+static void
+freerevalidator(struct FM *fm)
+{
+	struct Revalidate *rv;
+
+	rv = &fm->reval;
+	rv->running = false;
+	(void)close(rv->dirfd);
+	rv->dirfd = -1;
+	free(rv->path);
+	rv->path = NULL;
+	freedir(&rv->dir);
+}
+
+static bool
+closerevalidator(struct FM *fm)
+{
+	struct Revalidate *rv;
+
+	/* return whether the entries were left unrevalidated */
+	rv = &fm->reval;
+	if (!rv->running)
+		return false;
+	etlock(&rv->lock);
+	rv->cancel = true;
+	etunlock(&rv->lock);
+	etjoin(rv->thread, NULL);
+	freerevalidator(fm);
+	return true;
+}
+
+static void
+revalidatetake(struct FM *fm)
+{
+	struct Revalidate *rv;
+	struct WatchName *names, *name;
+	struct SortKey *keytmp;
+	Item *entry, *fresh, *tmp;
+	int *order, *newindex;
+	int i, n;
+	bool done, changed, resort;
+	char *s;
+
+	rv = &fm->reval;
+	if (!rv->running)
+		return;
+	etlock(&rv->lock);
+	done = rv->done;
+	etunlock(&rv->lock);
+	if (!done)
+		return;
+	etjoin(rv->thread, NULL);
+
+	/*
+	 * Entries whose metadata has changed are updated in place.  Only
+	 * a change in whether an entry is a directory (a symbolic link
+	 * whose target has been replaced) changes the order of entries.
+	 */
+	n = rv->dir.nentries;
+	names = emalloc(max(n, 1) * sizeof(*names));
+	for (i = 0; i < n; i++)
+		names[i] = (struct WatchName){ .name = rv->dir.entries[i].name, .index = i };
+	qsort(names, n, sizeof(*names), namecmp);
+	changed = resort = false;
+	for (i = 0; i < fm->dir.nentries; i++) {
+		entry = &fm->dir.entries[i];
+		name = bsearch(
+			&(struct WatchName){ .name = entry->name },
+			names,
+			n,
+			sizeof(*names),
+			namecmp
+		);
+		if (name == NULL)
+			continue;
+		fresh = &rv->dir.entries[name->index];
+		if (fresh->mode == 0)
+			continue;       /* entry could not be stat(2)ed */
+		if (fresh->mode == entry->mode && fresh->size == entry->size &&
+		    fresh->mtime == entry->mtime && fresh->uid == entry->uid &&
+		    fresh->gid == entry->gid)
+			continue;
+		if (isdir(fresh) != isdir(entry))
+			resort = true;
+		if (!changed)
+			thumbhold(fm);  /* until updateview() */
+		s = entry->name;
+		*entry = *fresh;
+		entry->name = s;
+		changed = true;
+	}
+	free(names);
+	if (changed) {
+		newindex = emalloc(fm->dir.nentries * sizeof(*newindex));
+		for (i = 0; i < fm->dir.nentries; i++)
+			newindex[i] = i;
+		if (resort) {
+			keytmp = emalloc(fm->dir.nentries * sizeof(*keytmp));
+			tmp = emalloc(fm->dir.nentries * sizeof(*tmp));
+			order = emalloc(fm->dir.nentries * sizeof(*order));
+			sortentries(&fm->dir, keytmp, tmp, 0, order);
+			for (i = 0; i < fm->dir.nentries; i++)
+				newindex[order[i]] = i;
+			free(keytmp);
+			free(tmp);
+			free(order);
+		}
+		updateview(fm, newindex, NULL, 0, NULL);
+		free(newindex);
+		fm->metadirty = true;
+	}
+	freerevalidator(fm);
+	createthumbthread(fm);
+}
+
+#ifdef __linux__
+static void
+applywatch(struct FM *fm, struct WatchName *names, int nnames)
+{
+	struct stat sb;
+	struct SortKey *keytmp;
+	struct WatchName *name;
+	Item *tmp;
+	int *from, *order, *newindex, *renew;
+	int i, j, k, nold, nkept, nrenew;
+	bool unverified;
+
+	/*
+	 * Each entry an event was about is removed from the entries and,
+	 * if it still exists, read again and inserted back as if it were
+	 * a new one (an update may even have made it change place, as a
+	 * file replaced by a directory).  The other entries are kept in
+	 * the order they are; so this costs O(n) plus the sorting of the
+	 * inserted entries, rather than reading the whole directory.
+	 *
+	 * from[] maps the (unsorted) new indices into the old ones, so
+	 * the widget can keep the selection and the thumbnails of the
+	 * entries that are still there.  The thumbnailers are left
+	 * running; of the entries already thumbnailed, only those read
+	 * again are thumbnailed again (see updateview()).
+	 */
+	qsort(names, nnames, sizeof(*names), namecmp);
+	for (i = j = 0; i < nnames; i++)
+		if (j == 0 || strcmp(names[j - 1].name, names[i].name) != 0)
+			names[j++] = names[i];
+	nnames = j;
+	unverified = closerevalidator(fm);
+	thumbhold(fm);
+	nold = fm->dir.nentries;
+	newindex = emalloc(nold * sizeof(*newindex));
+	from = emalloc((nold + nnames) * sizeof(*from));
+	for (i = j = 0; i < nold; i++) {
+		name = bsearch(
+			&(struct WatchName){ .name = fm->dir.entries[i].name },
+			names,
+			nnames,
+			sizeof(*names),
+			namecmp
+		);
+		newindex[i] = -1;
+		if (name != NULL) {
+			name->index = i;
+			continue;
+		}
+		fm->dir.entries[j] = fm->dir.entries[i];
+		fm->dir.keys[j] = fm->dir.keys[i];
+		fm->dir.keys[j].index = j;
+		from[j++] = i;
+	}
+	nkept = fm->dir.nentries = j;
+	for (i = 0; i < nnames; i++) {
+		if (!direntselect(names[i].name))
+			continue;
+		if (fstatat(fm->dirfd, names[i].name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;       /* entry is gone */
+		growentries(&fm->dir);
+		fm->dir.entries[fm->dir.nentries].name = arenastrdup(&fm->dir.arena, names[i].name);
+		from[fm->dir.nentries++] = names[i].index;
+	}
+	fillentries(fm, &fm->dir, fm->dirfd, fm->cwd->path, nkept, NSTATTHREADS);
+	keytmp = emalloc(fm->dir.nentries * sizeof(*keytmp));
+	tmp = emalloc(fm->dir.nentries * sizeof(*tmp));
+	order = emalloc(fm->dir.nentries * sizeof(*order));
+	sortentries(&fm->dir, keytmp, tmp, nkept, order);
+	renew = emalloc(fm->dir.nentries * sizeof(*renew));
+	nrenew = 0;
+	for (k = 0; k < fm->dir.nentries; k++) {
+		if (from[order[k]] != -1)
+			newindex[from[order[k]]] = k;
+		if (order[k] >= nkept) {
+			renew[nrenew++] = k;
+		}
+	}
+	updateview(fm, newindex, renew, nrenew, NULL);
+	free(keytmp);
+	free(tmp);
+	free(order);
+	free(renew);
+	free(from);
+	free(newindex);
+	fm->metadirty = true;
+	if (unverified)
+		revalidate(fm);
+	createthumbthread(fm);
+}
+
+static void
+readwatch(struct FM *fm, struct WatchEvents *evs)
+{
+	struct inotify_event *ev;
+	struct Snapshot *snap;
+	ssize_t len;
+	char *p;
+	union {
+		struct inotify_event ev;
+		char buf[WATCHBUFSIZE];
+	} u;
+
+	/*
+	 * Drain the queue of events.  Events about the entries of the
+	 * current directory are collected into evs (or discarded if evs
+	 * is NULL); events about a directory we have a snapshot of just
+	 * make the snapshot stale.
+	 */
+	for (;;) {
+		if ((len = read(fm->watchfd, u.buf, sizeof(u.buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				warn("inotify");
+				goto overflow;
+			}
+			break;
+		}
+		for (p = u.buf; p < u.buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW)
+				goto overflow;
+			if (ev->wd != fm->watch) {
+				for (snap = fm->snaphead; snap != NULL; snap = snap->next)
+					if (snap->watch == ev->wd)
+						snap->stale = true;
+				continue;
+			}
+			if (evs == NULL)
+				continue;
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT))
+				evs->reload = true;
+			if (ev->len == 0 || ev->name[0] == '\0')
+				continue;
+			if (evs->nnames >= evs->capacity) {
+				evs->capacity = evs->capacity > 0 ? evs->capacity * 2 : INCRSIZE;
+				evs->names = erealloc(evs->names, evs->capacity * sizeof(*evs->names));
+			}
+			evs->names[evs->nnames++] = (struct WatchName){
+				.name = arenastrdup(&evs->arena, ev->name),
+				.index = -1,
+			};
+		}
+	}
+	return;
+overflow:
+	/* we have lost events; nothing we know can be trusted */
+	for (snap = fm->snaphead; snap != NULL; snap = snap->next)
+		snap->stale = true;
+	if (evs != NULL)
+		evs->reload = true;
+	while (read(fm->watchfd, u.buf, sizeof(u.buf)) != -1 || errno == EINTR)
+		;
+}
+
+static int
+watchupdate(struct FM *fm)
+{
+	struct WatchEvents evs = { 0 };
+	struct stat sb;
+
+	/*
+	 * Get the ctime before reading the events, so a change made
+	 * after it is known by an event (for the snapshot of the
+	 * directory to be invalidated, see snaprestore()).  It becomes
+	 * the time of the entries only once the events are applied; if
+	 * the directory must be read again instead, the entries we have
+	 * are not to be cached under it (see metasave()).
+	 */
+	if (fstat(fm->dirfd, &sb) == -1)
+		return UPDATE_ERROR;
+	readwatch(fm, &evs);
+	if (evs.reload) {
+		fm->metadirty = false;
+	} else {
+		if (evs.nnames > 0)
+			applywatch(fm, evs.names, evs.nnames);
+		fm->time = sb.st_ctim;
+	}
+	free(evs.names);
+	arenafree(&evs.arena);
+	return evs.reload ? UPDATE_RELOAD : UPDATE_DONE;
+}
+#endif
+
+static void
+dirwatch(struct FM *fm, const char *path)
+{
+#ifdef __linux__
+	struct Snapshot *snap;
+
+	/*
+	 * Watch the directory for changes on its entries, so they can
+	 * be updated one by one, rather than read all over again.
+	 *
+	 * Events about the previous reading of the directory still in
+	 * the queue are discarded; they are no longer of our interest.
+	 */
+	if (fm->watchfd == -1)
+		return;
+	if (fm->watch != -1)
+		(void)inotify_rm_watch(fm->watchfd, fm->watch);
+	fm->watch = -1;
+	readwatch(fm, NULL);
+	if ((fm->watch = inotify_add_watch(fm->watchfd, path, WATCHMASK)) == -1) {
+		warn("%s", path);
+		return;
+	}
+
+	/*
+	 * A directory has a single watch descriptor, however many times
+	 * it is watched.  If a snapshot (of the same directory under
+	 * another path) holds the descriptor we got, it is ours now.
+	 */
+	for (snap = fm->snaphead; snap != NULL; snap = snap->next) {
+		if (snap->watch == fm->watch) {
+			snap->watch = -1;
+			snap->stale = true;
+		}
+	}
+#else
+	(void)fm;
+	(void)path;
+#endif
+}
+
+static int
+dirupdate(struct FM *fm)
+{
+	struct stat sb;
+
+	/*
+	 * Bring the entries up to date with the directory we are at.
+	 *
+	 * If we are watching the directory, only the entries we have got
+	 * events about are updated.  Otherwise, the whole directory must
+	 * be read again if its ctime has changed.
+	 */
+#ifdef __linux__
+	if (fm->watch != -1)
+		return watchupdate(fm);
+#endif
+	if (fstat(fm->dirfd, &sb) == -1)
+		return UPDATE_ERROR;
+	if (!timespeclt(&fm->time, &sb.st_ctim))
+		return UPDATE_DONE;
+	return UPDATE_RELOAD;
+}
+
+static bool
+loadcancelled(struct Load *ld)
+{
+	bool ret;
+
+	etlock(&ld->lock);
+	ret = ld->cancel;
+	etunlock(&ld->lock);
+	return ret;
+}
+
+static void
+loadpublish(struct FM *fm, const int *order, int nsorted, bool done)
+{
+	struct Load *ld;
+	Item *entries;
+	int *newindex;
+	int i, n;
+
+	/*
+	 * The entries [0, nsorted) have just been merged with the new
+	 * ones; order[k] is the index the entry now at k had before.
+	 */
+	ld = &fm->load;
+	n = ld->dir.nentries;
+	newindex = emalloc(max(nsorted, 1) * sizeof(*newindex));
+	for (i = 0; i < n; i++)
+		if (order[i] < nsorted)
+			newindex[order[i]] = i;
+	entries = NULL;
+	if (!done) {
+		entries = emalloc(max(n, 1) * sizeof(*entries));
+		(void)memcpy(entries, ld->dir.entries, n * sizeof(*entries));
+	}
+	etlock(&ld->lock);
+	if (ld->ready) {
+		/* the main thread still shows the entries before the last ones */
+		for (i = 0; i < ld->nold; i++)
+			ld->newindex[i] = newindex[ld->newindex[i]];
+		free(newindex);
+	} else {
+		ld->newindex = newindex;
+		ld->nold = nsorted;
+	}
+	free(ld->entries);
+	ld->entries = entries;
+	ld->nentries = n;
+	ld->ready = true;
+	ld->done = done;
+	etunlock(&ld->lock);
+	widget_wakeup(fm->widget);
+}
+
+static void *
+loader(void *arg)
+{
+	struct FM *fm;
+	struct Load *ld;
+	struct Dir view;
+	struct dirent *dp;
+	struct SortKey *keytmp;
+	Item *tmp;
+	int *order;
+	int first, nsorted, nbatch;
+	bool done;
+
+	/*
+	 * Read the directory in batches, and show what we have got so
+	 * far at the end of each batch; so the user gets the first
+	 * screenful without waiting for the whole directory to be read.
+	 *
+	 * Each batch is as large as all the previous ones together.
+	 * Sorting a batch and merging it into the previous (already
+	 * sorted) entries keeps the whole thing at O(n*log(n)); and the
+	 * directory is shown only O(log(n)) times.
+	 *
+	 * Check every once in a while whether the user has gone
+	 * somewhere else, even in the middle of a batch.
+	 */
+	fm = (struct FM *)arg;
+	ld = &fm->load;
+	keytmp = NULL;
+	tmp = NULL;
+	order = NULL;
+	nsorted = 0;
+	nbatch = FIRSTBATCH;
+	done = false;
+	while (!done) {
+		errno = 0;
+		if ((dp = readdir(ld->dirp)) == NULL) {
+			if (errno != 0)
+				warn("%s", ld->path);
+			done = true;
+		} else if (direntselect(dp->d_name)) {
+			growentries(&ld->dir);
+			ld->dir.entries[ld->dir.nentries++].name = arenastrdup(&ld->dir.arena, dp->d_name);
+			if (ld->dir.nentries % LOADBATCH == 0 && loadcancelled(ld)) {
+				break;
+			}
+		}
+		if (!done && ld->dir.nentries - nsorted < nbatch)
+			continue;
+		for (first = nsorted; first < ld->dir.nentries; first = view.nentries) {
+			if (loadcancelled(ld))
+				goto cancelled;
+			view = (struct Dir){
+				.entries = ld->dir.entries,
+				.nentries = min(first + LOADBATCH, ld->dir.nentries),
+			};
+			fillentries(fm, &view, dirfd(ld->dirp), ld->path, first, NSTATTHREADS);
+		}
+		if (ld->dir.nentries > 0) {
+			keytmp = erealloc(keytmp, ld->dir.nentries * sizeof(*keytmp));
+			tmp = erealloc(tmp, ld->dir.nentries * sizeof(*tmp));
+			order = erealloc(order, ld->dir.nentries * sizeof(*order));
+		}
+		sortentries(&ld->dir, keytmp, tmp, nsorted, order);
+		loadpublish(fm, order, nsorted, done);
+		nsorted = nbatch = ld->dir.nentries;
+	}
+cancelled:
+	free(keytmp);
+	free(tmp);
+	free(order);
+	return NULL;
+}
+
+static void
+freeloader(struct FM *fm)
+{
+	struct Load *ld;
+
+	ld = &fm->load;
+	(void)closedir(ld->dirp);
+	freedir(&ld->dir);
+	free(ld->entries);
+	free(ld->newindex);
+	free(ld->path);
+	ld->dirp = NULL;
+	ld->entries = NULL;
+	ld->newindex = NULL;
+	ld->path = NULL;
+	ld->running = false;
+}
+
+static bool
+loadtake(struct FM *fm)
+{
+	struct Load *ld;
+	Item *entries;
+	int *newindex;
+	int n;
+	bool ready, done;
+
+	/*
+	 * Show the entries the loader thread has given us, if any.
+	 * Return whether it is done with them.
+	 */
+	ld = &fm->load;
+	if (!ld->running)
+		return false;
+	etlock(&ld->lock);
+	ready = ld->ready;
+	done = ld->done;
+	entries = ld->entries;
+	newindex = ld->newindex;
+	n = ld->nentries;
+	ld->ready = false;
+	ld->entries = NULL;
+	ld->newindex = NULL;
+	etunlock(&ld->lock);
+	if (!ready)
+		return false;
+
+	/*
+	 * Until the thread is done, our entries are a copy of those it
+	 * has read, with names it owns; we only show them, but change
+	 * nothing in them (see closeloader()).
+	 */
+	freedir(&fm->dir);
+	if (done) {
+		etjoin(ld->thread, NULL);
+		fm->dir = ld->dir;
+		ld->dir = (struct Dir){ 0 };
+		freeloader(fm);
+	} else {
+		fm->dir.entries = entries;
+		fm->dir.nentries = n;
+		fm->dir.capacity = n;
+	}
+	updateview(fm, newindex, NULL, 0, &ld->scrl);
+	free(newindex);
+	if (done)
+		fm->metadirty = true;
+	else
+		widget_busy(fm->widget);
+	return done;
+}
+
+static bool
+closeloader(struct FM *fm)
+{
+	struct Load *ld;
+	bool done;
+
+	/*
+	 * Stop reading the directory.  Return whether the entries were
+	 * left unread; if so, the ones we have got so far are freed: the
+	 * caller must give the widget other entries (or exit) before the
+	 * widget draws again.
+	 */
+	ld = &fm->load;
+	if (!ld->running)
+		return false;
+	etlock(&ld->lock);
+	done = ld->done;
+	ld->cancel = true;
+	etunlock(&ld->lock);
+	if (done) {
+		(void)loadtake(fm);
+		return false;
+	}
+	etjoin(ld->thread, NULL);
+	freeloader(fm);
+	freedir(&fm->dir);
+	return true;
+}
+
+static int
+dirload(struct FM *fm, Scroll *scrl)
+{
+	struct Load *ld;
+	int fd;
+
+	/*
+	 * Start reading the directory in the background (see loader()).
+	 * The widget is emptied now, for it not to show the entries of
+	 * the directory we have left under the path of this one.
+	 */
+	ld = &fm->load;
+	dirwatch(fm, fm->cwd->path);
+	/*
+	 * Read from a new open file description, rather than from a
+	 * dup(2) of fm->dirfd, for it not to share the offset with
+	 * previous readings of the directory.
+	 */
+	if ((fd = openat(fm->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		err(EXIT_FAILURE, "%s", fm->cwd->path);
+	if ((ld->dirp = fdopendir(fd)) == NULL)
+		err(EXIT_FAILURE, "%s", fm->cwd->path);
+	ld->path = estrdup(fm->cwd->path);
+	ld->dir = (struct Dir){ 0 };
+	ld->scrl = (scrl != NULL) ? *scrl : (Scroll){ .row = 0, .ydiff = 0, .highlight = -1 };
+	ld->cancel = false;
+	ld->ready = false;
+	ld->done = false;
+	ld->running = true;
+	freedir(&fm->dir);
+	fm->metadirty = false;
+	etcreate(&ld->thread, loader, fm);
+	return setentries(fm, NULL);
+}
+
+static int
+metapath(struct FM *fm, const char *path, char *buf)
+{
+	int i, n;
+
+	/* the cache file is named after the directory, as thumbnails are */
+	n = snprintf(buf, PATH_MAX, "%s/%s", fm->metadir, path);
+	if (n < 0 || n >= PATH_MAX)
+		return RETURN_FAILURE;
+	for (i = strlen(fm->metadir) + 1; buf[i] != '\0'; i++)
+		if (buf[i] == '/')
+			buf[i] = '%';
+	return RETURN_SUCCESS;
+}
+
+static bool
+metatimeeq(const int64_t t[2], struct timespec *ts)
+{
+	return t[0] == (int64_t)ts->tv_sec && t[1] == (int64_t)ts->tv_nsec;
+}
+
+static void
+metasave(struct FM *fm)
+{
+	struct MetaHeader *hdr;
+	struct MetaRecord *rec;
+	struct stat sb;
+	Item *entry;
+	size_t namesize, size, len, off;
+	ssize_t n;
+	int fd, i;
+	char *buf, *names;
+	char path[PATH_MAX];
+	char tmppath[PATH_MAX];
+
+	/*
+	 * Write the entries into the cache, if they are the ones of the
+	 * directory as it is now.  The file is written aside and renamed
+	 * over the old one, so a reader never maps a partial file.
+	 */
+	if (fm->metadir == NULL || !fm->metadirty || fm->dirfd == -1 || fm->last == NULL)
+		return;
+	fm->metadirty = false;
+	if (fstat(fm->dirfd, &sb) == -1)
+		return;
+	if (sb.st_ctim.tv_sec != fm->time.tv_sec || sb.st_ctim.tv_nsec != fm->time.tv_nsec)
+		return;
+	if (metapath(fm, fm->last->path, path) == RETURN_FAILURE)
+		return;
+	namesize = 0;
+	for (i = 0; i < fm->dir.nentries; i++)
+		namesize += strlen(fm->dir.entries[i].name) + 1;
+	if (namesize > UINT32_MAX)
+		return;
+	size = sizeof(*hdr) + fm->dir.nentries * sizeof(*rec) + namesize;
+	buf = ecalloc(1, size);
+	hdr = (struct MetaHeader *)buf;
+	rec = (struct MetaRecord *)(hdr + 1);
+	names = (char *)(rec + fm->dir.nentries);
+	(void)memcpy(hdr->magic, METAMAGIC, sizeof(hdr->magic));
+	hdr->nentries = fm->dir.nentries;
+	hdr->namesize = namesize;
+	hdr->mtime[0] = sb.st_mtim.tv_sec;
+	hdr->mtime[1] = sb.st_mtim.tv_nsec;
+	hdr->ctime[0] = sb.st_ctim.tv_sec;
+	hdr->ctime[1] = sb.st_ctim.tv_nsec;
+	for (off = 0, i = 0; i < fm->dir.nentries; i++) {
+		entry = &fm->dir.entries[i];
+		len = strlen(entry->name) + 1;
+		(void)memcpy(names + off, entry->name, len);
+		rec[i] = (struct MetaRecord){
+			.size = entry->size,
+			.mtime = entry->mtime,
+			.name = off,
+			.uid = entry->uid,
+			.gid = entry->gid,
+			.mode = entry->mode,
+		};
+		off += len;
+	}
+	(void)snprintf(tmppath, PATH_MAX, "%s/.XXXXXX", fm->metadir);
+	if ((fd = mkstemp(tmppath)) == -1) {
+		warn("%s", tmppath);
+		goto done;
+	}
+	for (off = 0; off < size; off += n) {
+		if ((n = write(fd, buf + off, size - off)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			warn("%s", tmppath);
+			break;
+		}
+	}
+	if (close(fd) == -1 || off < size || rename(tmppath, path) == -1)
+		(void)unlink(tmppath);
+done:
+	free(buf);
+}
+
+static int
+metaload(struct FM *fm, Scroll *scrl)
+{
+	struct MetaHeader *hdr;
+	struct MetaRecord *rec;
+	struct SortKey *keytmp;
+	struct stat sb;
+	Item *tmp, *entry;
+	size_t size;
+	uint32_t i;
+	int fd, retval;
+	char *map, *names;
+	char path[PATH_MAX];
+
+	/*
+	 * Paint the entries from the metadata cache, without stat(2)ing
+	 * any of them; they are revalidated in the background.  The
+	 * cache is only used if the directory has not changed since it
+	 * was written, so the names in it are still those in the
+	 * directory.
+	 */
+	if (fm->metadir == NULL || metapath(fm, fm->cwd->path, path) == RETURN_FAILURE)
+		return RETURN_FAILURE;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return RETURN_FAILURE;
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr)) {
+		(void)close(fd);
+		return RETURN_FAILURE;
+	}
+	size = sb.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED)
+		return RETURN_FAILURE;
+	retval = RETURN_FAILURE;
+	hdr = (struct MetaHeader *)map;
+	rec = (struct MetaRecord *)(hdr + 1);
+	names = (char *)(rec + hdr->nentries);
+	if (memcmp(hdr->magic, METAMAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->nentries > (size - sizeof(*hdr)) / sizeof(*rec) ||
+	    size - sizeof(*hdr) - hdr->nentries * sizeof(*rec) != hdr->namesize ||
+	    hdr->namesize == 0 || names[hdr->namesize - 1] != '\0')
+		goto done;
+
+	/* as in snaprestore(), watch the directory before checking it */
+	dirwatch(fm, fm->cwd->path);
+	if (fstat(fm->dirfd, &sb) == -1)
+		err(EXIT_FAILURE, "fstat");
+	fm->time = sb.st_ctim;
+	if (!metatimeeq(hdr->mtime, &sb.st_mtim) || !metatimeeq(hdr->ctime, &sb.st_ctim))
+		goto done;
+	resetdir(&fm->dir);
+	for (i = 0; i < hdr->nentries; i++) {
+		if (rec[i].name >= hdr->namesize) {
+			fm->dir.nentries = 0;
+			goto done;
+		}
+		if (!direntselect(names + rec[i].name))
+			continue;
+		growentries(&fm->dir);
+		entry = &fm->dir.entries[fm->dir.nentries++];
+		*entry = (Item){
+			.mode = rec[i].mode,
+			.name = arenastrdup(&fm->dir.arena, names + rec[i].name),
+			.size = rec[i].size,
+			.mtime = rec[i].mtime,
+			.uid = rec[i].uid,
+			.gid = rec[i].gid,
+		};
+		entry->icon = geticon(fm, fm->cwd->path, entry);
+	}
+	if (fm->dir.nentries > 0) {
+		keytmp = emalloc(fm->dir.nentries * sizeof(*keytmp));
+		tmp = emalloc(fm->dir.nentries * sizeof(*tmp));
+		sortentries(&fm->dir, keytmp, tmp, 0, NULL);
+		free(keytmp);
+		free(tmp);
+	}
+	retval = setentries(fm, scrl);
+	revalidate(fm);
+done:
+	(void)munmap(map, size);
+	return retval;
+}
+
+static void
+snapfree(struct FM *fm, struct Snapshot *snap)
+{
+	if (snap->prev != NULL)
+		snap->prev->next = snap->next;
+	else
+		fm->snaphead = snap->next;
+	if (snap->next != NULL)
+		snap->next->prev = snap->prev;
+	else
+		fm->snaptail = snap->prev;
+#ifdef __linux__
+	if (snap->watch != -1)
+		(void)inotify_rm_watch(fm->watchfd, snap->watch);
+#endif
+	fm->snapsize -= snap->size;
+	freedir(&snap->dir);
+	free(snap->path);
+	free(snap);
+}
+
+static void
+snaptrim(struct FM *fm)
+{
+	while (fm->snaptail != NULL && fm->snapsize > fm->snapbudget) {
+		snapfree(fm, fm->snaptail);
+	}
+}
+
+static void
+snapinsert(struct FM *fm, const char *path, struct timespec *time, struct Dir *dir, int watch)
+{
+	struct Snapshot *snap;
+
+	snap = emalloc(sizeof(*snap));
+	*snap = (struct Snapshot){
+		.prev = NULL,
+		.next = fm->snaphead,
+		.path = estrdup(path),
+		.time = *time,
+		.dir = *dir,
+		.watch = watch,
+		.stale = false,
+	};
+	snap->size = sizeof(*snap) + arenasize(&snap->dir.arena) + arenasize(&snap->dir.keyarena) +
+	             snap->dir.capacity * (sizeof(*snap->dir.entries) + sizeof(*snap->dir.keys));
+	if (fm->snaphead != NULL)
+		fm->snaphead->prev = snap;
+	else
+		fm->snaptail = snap;
+	fm->snaphead = snap;
+	fm->snapsize += snap->size;
+	*dir = (struct Dir){ 0 };
+}
+
+static void
+snapsave(struct FM *fm, const char *path, struct timespec *time)
+{
+	/*
+	 * We are leaving the directory.  Rather than freeing its entries,
+	 * move them (and the watch on the directory) into a snapshot at
+	 * the head of the cache.  The cache is trimmed to its budget
+	 * later, once the widget no longer displays those entries.
+	 */
+	if (fm->snapbudget == 0 || fm->dir.nentries == 0)
+		return;
+	snapinsert(fm, path, time, &fm->dir, fm->watch);
+	fm->watch = -1;
+}
+
+static int
+snaprestore(struct FM *fm, Scroll *scrl)
+{
+	struct Snapshot *snap;
+	struct stat sb;
+
+	for (snap = fm->snaphead; snap != NULL; snap = snap->next)
+		if (strcmp(snap->path, fm->cwd->path) == 0)
+			break;
+	if (snap == NULL)
+		return RETURN_FAILURE;
+#ifdef __linux__
+	if (fm->watchfd != -1)
+		readwatch(fm, NULL);
+#endif
+
+	/*
+	 * A prefetched snapshot has no watch on its directory; watch it
+	 * before checking its ctime, so no change goes unnoticed.
+	 */
+	if (snap->watch == -1)
+		dirwatch(fm, fm->cwd->path);
+	if (fstat(fm->dirfd, &sb) == -1)
+		err(EXIT_FAILURE, "fstat");
+	fm->time = sb.st_ctim;
+	if (snap->stale ||
+	    snap->time.tv_sec != fm->time.tv_sec ||
+	    snap->time.tv_nsec != fm->time.tv_nsec) {
+		snapfree(fm, snap);
+		return RETURN_FAILURE;
+	}
+
+	/* the directory has not changed; take its entries back */
+	freedir(&fm->dir);
+	fm->dir = snap->dir;
+	snap->dir = (struct Dir){ 0 };
+	if (snap->watch != -1) {
+#ifdef __linux__
+		if (fm->watch != -1)
+			(void)inotify_rm_watch(fm->watchfd, fm->watch);
+#endif
+		fm->watch = snap->watch;
+		snap->watch = -1;
+	}
+	snapfree(fm, snap);
+	return setentries(fm, scrl);
+}
+
+static bool
+prefetchcancelled(struct Prefetch *pf, unsigned long gen)
+{
+	bool ret;
+
+	etlock(&pf->lock);
+	ret = pf->exit || pf->gen != gen;
+	etunlock(&pf->lock);
+	return ret;
+}
+
+static int
+prefetchdir(struct FM *fm, const char *path, unsigned long gen)
+{
+	struct Prefetch *pf;
+	struct Dir dir = { 0 };
+	struct SortKey *keytmp;
+	struct stat sb;
+	struct dirent *dp;
+	DIR *dirp;
+	Item *tmp;
+	int fd, nfilled, retval;
+	char buf[PATH_MAX];
+
+	/*
+	 * Read the directory as dirload() does, but quietly in the
+	 * background: stat(2) the entries from this thread alone, and
+	 * give up as soon as the user highlights something else.
+	 */
+	pf = &fm->prefetch;
+	if (realpath(path, buf) == NULL)
+		return RETURN_FAILURE;
+	if ((fd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return RETURN_FAILURE;
+	if (fstat(fd, &sb) == -1 || (dirp = fdopendir(fd)) == NULL) {
+		(void)close(fd);
+		return RETURN_FAILURE;
+	}
+	retval = RETURN_FAILURE;
+	nfilled = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!direntselect(dp->d_name))
+			continue;
+		growentries(&dir);
+		dir.entries[dir.nentries++].name = arenastrdup(&dir.arena, dp->d_name);
+		if (dir.nentries - nfilled < PREFETCHBATCH)
+			continue;
+		fillentries(fm, &dir, fd, buf, nfilled, 1);
+		nfilled = dir.nentries;
+		if (prefetchcancelled(pf, gen)) {
+			goto done;
+		}
+	}
+	fillentries(fm, &dir, fd, buf, nfilled, 1);
+	if (prefetchcancelled(pf, gen))
+		goto done;
+	if (dir.nentries > 0) {
+		keytmp = emalloc(dir.nentries * sizeof(*keytmp));
+		tmp = emalloc(dir.nentries * sizeof(*tmp));
+		sortentries(&dir, keytmp, tmp, 0, NULL);
+		free(keytmp);
+		free(tmp);
 	}
-	return pid;
-}
-
-static int
-timespeclt(struct timespec *tsp, struct timespec *usp)
-{
-	return (tsp->tv_sec == usp->tv_sec)
-	     ? (tsp->tv_nsec < usp->tv_nsec)
-	     : (tsp->tv_sec < usp->tv_sec);
+	etlock(&pf->lock);
+	if (pf->gen == gen) {
+		freedir(&pf->dir);
+		free(pf->donepath);
+		pf->dir = dir;
+		pf->donepath = estrdup(buf);
+		pf->time = sb.st_ctim;
+		dir = (struct Dir){ 0 };
+		retval = RETURN_SUCCESS;
+	}
+	etunlock(&pf->lock);
+done:
+	(void)closedir(dirp);
+	freedir(&dir);
+	return retval;
 }
 
-static bool
-checkicon(struct FM *fm, Item *entry, struct IconPatt *icon)
+static void *
+prefetcher(void *arg)
 {
-	int flags;
-	char *s, *t;
+	struct FM *fm;
+	struct Prefetch *pf;
+	unsigned long gen;
+	char *path;
 
-	t = icon->patt;
-	if (t == NULL)
-		return false;
-	if (t[0] == '~' || strchr(t, '/') != NULL) {
-		flags = FNM_CASEFOLD | FNM_PATHNAME;
-		s = entry->fullname;
-	} else {
-		flags = FNM_CASEFOLD;
-		s = entry->name;
-	}
-	if (s == NULL)
-		return false;
-	if (t[0] == '~') {
-		if (strncmp(fm->home, s, fm->homelen) != 0)
-			return false;
-		t++;
-		s += fm->homelen;
+	fm = (struct FM *)arg;
+	pf = &fm->prefetch;
+	etlock(&pf->lock);
+	for (;;) {
+		while (!pf->exit && pf->path == NULL)
+			etwait(&pf->cond, &pf->lock);
+		if (pf->exit)
+			break;
+		path = pf->path;
+		pf->path = NULL;
+		gen = pf->gen;
+		etunlock(&pf->lock);
+		(void)prefetchdir(fm, path, gen);
+		free(path);
+		etlock(&pf->lock);
 	}
-	return s != NULL &&
-		((icon->mode & MODE_MASK) == MODE_ANY ||
-		(icon->mode & MODE_MASK) == (entry->mode & MODE_MASK)) &&
-		(!(icon->mode & MODE_LINK) || (entry->mode & MODE_LINK)) &&
-		(!(icon->mode & MODE_EXEC) || (entry->mode & MODE_EXEC)) &&
-		(!(icon->mode & MODE_READ) || (entry->mode & MODE_READ)) &&
-		(!(icon->mode & MODE_WRITE) || (entry->mode & MODE_WRITE)) &&
-		fnmatch(t, s, flags) == 0;
+	etunlock(&pf->lock);
+	return NULL;
 }
 
-static size_t
-geticon(struct FM *fm, Item *entry)
+static void
+prefetch(struct FM *fm, const char *path)
 {
-	size_t i;
+	struct Prefetch *pf;
 
-	/* parent directory is a special case */
-	if (strcmp(entry->name, "..") == 0)
-		return icon_for_updir;
-	/* first check user-defined matches */
-	for (i = 0; i < fm->nuserpatts; i++)
-		if (checkicon(fm, entry, &fm->userpatts[i]))
-			return fm->userpatts[i].index;
-	/* then check hardcoded icon matches */
-	for (i = 0; i < nicon_patts; i++)
-		if (checkicon(fm, entry, &icon_patts[i]))
-			return icon_patts[i].index;
-	/* just return directory or regular file then */
-	if (isdir(entry))
-		return icon_for_dir;
-	return icon_for_file;
+	pf = &fm->prefetch;
+	if (!pf->running)
+		return;
+	etlock(&pf->lock);
+	pf->gen++;
+	free(pf->path);
+	pf->path = (path != NULL) ? estrdup(path) : NULL;
+	etsignal(&pf->cond);
+	etunlock(&pf->lock);
 }
 
-static int
-thumbexists(Item *entry, char *mime)
+static void
+prefetchtake(struct FM *fm)
 {
-	struct stat sb;
-	struct timespec origt, mimet;
-	pid_t pid;
-	int status;
+	struct Prefetch *pf;
 
-	if (stat(mime, &sb) == -1)
-		goto forkthumbnailer;
-	mimet = sb.st_mtim;
-	if (stat(entry->fullname, &sb) == -1)
-		goto forkthumbnailer;
-	origt = sb.st_mtim;
-	if (timespeclt(&origt, &mimet))
-		return true;
-forkthumbnailer:
-	pid = forkthumb(entry->fullname, mime);
-	if (waitpid(pid, &status, 0) == -1)
-		return false;
-	return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	/*
+	 * If the directory we are changing into is the one that has been
+	 * prefetched, put its entries in the cache; snaprestore() takes
+	 * them from there if the directory has not changed since.
+	 */
+	pf = &fm->prefetch;
+	if (!pf->running)
+		return;
+	etlock(&pf->lock);
+	pf->gen++;              /* cancel whatever is being prefetched */
+	free(pf->path);
+	pf->path = NULL;
+	if (pf->donepath != NULL && strcmp(pf->donepath, fm->cwd->path) == 0)
+		snapinsert(fm, pf->donepath, &pf->time, &pf->dir, -1);
+	freedir(&pf->dir);
+	free(pf->donepath);
+	pf->donepath = NULL;
+	etunlock(&pf->lock);
 }
 
-static void *
-thumbnailer(void *arg)
+static void
+highlighted(void *arg, int index)
 {
 	struct FM *fm;
-	int i;
-	char path[PATH_MAX];
+	struct Snapshot *snap;
+	char buf[PATH_MAX];
+	char *path;
 
 	fm = (struct FM *)arg;
-	for (i = 0; i < fm->nentries; i++) {
-		if (thumbexit(fm))
-			break;
-		if (fm->entries[i].fullname == NULL)
-			continue;
-		if (strncmp(fm->entries[i].fullname, fm->thumbnaildir, fm->thumbnaildirlen) == 0)
-			continue;
-		if (setthumbpath(fm, fm->entries[i].fullname, path) == RETURN_FAILURE)
-			continue;
-		if (thumbexists(&fm->entries[i], path)) {
-			widget_thumb(fm->widget, path, i);
+	path = NULL;
+	if (index >= 0 && index < fm->nview && isdir(&fm->view[index])) {
+		path = entrypath(fm, index, buf);
+		for (snap = fm->snaphead; snap != NULL; snap = snap->next) {
+			if (!snap->stale && strcmp(snap->path, path) == 0) {
+				path = NULL;    /* we already have it */
+				break;
+			}
 		}
 	}
-	pthread_exit(0);
+	prefetch(fm, path);
 }
 
 static void
-closethumbthread(struct FM *fm)
+closeprefetcher(struct FM *fm)
 {
-	if (fm->thumbnaildir == NULL)
+	struct Prefetch *pf;
+
+	pf = &fm->prefetch;
+	if (!pf->running)
 		return;
-	etlock(&fm->thumblock);
-	fm->thumbexit = 1;
-	etunlock(&fm->thumblock);
-	etjoin(fm->thumbthread, NULL);
-	etlock(&fm->thumblock);
-	fm->thumbexit = 0;
-	etunlock(&fm->thumblock);
+	etlock(&pf->lock);
+	pf->exit = true;
+	etsignal(&pf->cond);
+	etunlock(&pf->lock);
+	etjoin(pf->thread, NULL);
+	pf->running = false;
+	free(pf->path);
+	free(pf->donepath);
+	freedir(&pf->dir);
 }
 
 static void
-createthumbthread(struct FM *fm)
+initprefetcher(struct FM *fm)
 {
-	if (fm->thumbnaildir == NULL)
+	if (fm->snapbudget == 0)
 		return;
-	etcreate(&fm->thumbthread, thumbnailer, (void *)fm);
+	fm->prefetch.running = true;
+	etcreate(&fm->prefetch.thread, prefetcher, fm);
+	widget_onhighlight(fm->widget, highlighted, fm);
 }
 
-static unsigned char
-filemode(struct FM *fm, struct stat *sb, char *name)
+static void
+initdircache(struct FM *fm)
 {
-	bool ismember;
-	struct stat lsb;
-	size_t perm_off;
-	unsigned char mask, type;
-	int i;
+	unsigned long n;
+	char *str, *endp;
 
-	mask = 0x00;
-	if (S_ISLNK(sb->st_mode)) {
-		mask |= MODE_LINK;
-		if (stat(name, &lsb) == -1) {
-			type = MODE_BROK;
-			goto done;
-		}
-		sb = &lsb;
+	fm->snapbudget = (size_t)DEF_DIRCACHE << 20;
+	if ((str = widget_getresource(fm->widget, DIRCACHE_CLASS, DIRCACHE_NAME)) == NULL)
+		return;
+	errno = 0;
+	n = strtoul(str, &endp, 10);
+	if (str[0] == '\0' || *endp != '\0' || errno == ERANGE || n > SIZE_MAX >> 20)
+		warnx("%s: invalid value for %s", str, DIRCACHE_NAME);
+	else
+		fm->snapbudget = (size_t)n << 20;
+	free(str);
+}
+
+static void
+initthumbjobs(struct FM *fm)
+{
+	long n;
+	char *str, *endp;
+
+	/* as many thumbnailers as processors, unless set otherwise */
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+	fm->nthumbjobs = min(n, MAXTHUMBJOBS);
+	fm->thumbtimeout = DEF_THUMBTIME;
+	if ((str = widget_getresource(fm->widget, THUMBJOBS_CLASS, THUMBJOBS_NAME)) != NULL) {
+		errno = 0;
+		n = strtol(str, &endp, 10);
+		if (str[0] == '\0' || *endp != '\0' || errno == ERANGE || n < 1 || n > MAXTHUMBJOBS)
+			warnx("%s: invalid value for %s", str, THUMBJOBS_NAME);
+		else
+			fm->nthumbjobs = n;
+		free(str);
 	}
-	switch (sb->st_mode & S_IFMT) {
-	case S_IFBLK:   type = MODE_DEV;     break;
-	case S_IFCHR:   type = MODE_DEV;     break;
-	case S_IFDIR:   type = MODE_DIR;     break;
-	case S_IFIFO:   type = MODE_FIFO;    break;
-	case S_IFSOCK:  type = MODE_SOCK;    break;
-	default:        type = MODE_FILE;    break;
+	if ((str = widget_getresource(fm->widget, THUMBTIME_CLASS, THUMBTIME_NAME)) != NULL) {
+		errno = 0;
+		n = strtol(str, &endp, 10);
+		if (str[0] == '\0' || *endp != '\0' || errno == ERANGE || n < 0 || n > INT_MAX / 1000)
+			warnx("%s: invalid value for %s", str, THUMBTIME_NAME);
+		else
+			fm->thumbtimeout = n;
+		free(str);
 	}
-done:
-	ismember = false;
-	for (i = 0; i < fm->ngrps; i++) {
-		if (fm->grps[i] == sb->st_gid) {
-			ismember = true;
-			break;
-		}
+	if ((str = widget_getresource(fm->widget, THUMBCOPROC_CLASS, THUMBCOPROC_NAME)) != NULL) {
+		fm->thumbcoproc = strcasecmp(str, "on") == 0
+		               || strcasecmp(str, "true") == 0
+		               || strcmp(str, "1") == 0;
+		free(str);
 	}
-	if (sb->st_uid == fm->uid)
-		perm_off = 0;
-	else if (sb->st_gid == fm->gid || ismember)
-		perm_off = 3;
-	else
-		perm_off = 6;
-	if (sb->st_mode & (S_IRUSR >> perm_off))
-		mask |= MODE_READ;
-	if (sb->st_mode & (S_IWUSR >> perm_off))
-		mask |= MODE_WRITE;
-	if (sb->st_mode & (S_IXUSR >> perm_off))
-		mask |= MODE_EXEC;
-	return type | mask;
+	widget_onscroll(fm->widget, scrolled, fm);
 }
 
-static int
-diropen(struct FM *fm, struct Cwd *cwd, const char *path)
+static void
+initmetacache(struct FM *fm)
 {
-	struct dirent **array;
-	struct stat sb;
-	int i;
-	char buf[PATH_MAX];
+	char *str;
+	bool enable;
+	char path[PATH_MAX];
 
-	if (path != NULL && wchdir(path) == RETURN_FAILURE)
-		return RETURN_FAILURE;
-	free(cwd->path);
-	free(cwd->here);
-	egetcwd(buf, sizeof(buf));
-	if (stat(buf, &sb) == -1)
-		err(EXIT_FAILURE, "stat");
-	cwd->path = estrdup(buf);
-	fm->time = sb.st_ctim;
-	freeentries(fm);
-	fm->nentries = escandir(cwd->path, &array, direntselect, NULL);
-	if (fm->nentries > fm->capacity) {
-		fm->selitems = erealloc(fm->selitems, fm->nentries * sizeof(*fm->selitems));
-		fm->entries = erealloc(fm->entries, fm->nentries * sizeof(*fm->entries));
-		fm->capacity = fm->nentries;
-	}
-	for (i = 0; i < fm->nentries; i++) {
-		if (lstat(array[i]->d_name, &sb) == -1) {
-			warn("%s", array[i]->d_name);
-			fm->entries[i].status = NULL;
-			fm->entries[i].mode = 0;
-		} else {
-			fm->entries[i].status = statusfmt(&sb);
-			fm->entries[i].mode = filemode(fm, &sb, array[i]->d_name);
-		}
-		fm->entries[i].name = estrdup(array[i]->d_name);
-		fm->entries[i].fullname = fullpath(cwd->path, array[i]->d_name);
-		fm->entries[i].icon = geticon(fm, &fm->entries[i]);
-		free(array[i]);
-	}
-	free(array);
-	qsort(fm->entries, fm->nentries, sizeof(*fm->entries), entrycmp);
-	if (strstr(cwd->path, fm->home) == cwd->path &&
-	    (cwd->path[fm->homelen] == '/' || cwd->path[fm->homelen] == '\0')) {
-		snprintf(buf, PATH_MAX, "~%s", cwd->path + fm->homelen);
-	} else {
-		snprintf(buf, PATH_MAX, "%s", cwd->path);
+	if (fm->thumbnaildir == NULL)
+		return;
+	if ((str = widget_getresource(fm->widget, METACACHE_CLASS, METACACHE_NAME)) == NULL)
+		return;
+	enable = strcasecmp(str, "on") == 0
+	      || strcasecmp(str, "true") == 0
+	      || strcmp(str, "1") == 0;
+	free(str);
+	if (!enable)
+		return;
+	(void)snprintf(path, PATH_MAX, "%s/%s", fm->thumbnaildir, METADIR);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		warn("%s", path);
+		return;
 	}
-	cwd->here = estrdup(buf);
-	return RETURN_SUCCESS;
+	fm->metadir = estrdup(path);
 }
 
 static void
@@ -702,27 +3249,32 @@ runxfilesctl(struct FM *fm, char **argv, char *path)
 static WidgetEvent
 runcontext(struct FM *fm, char *cmd, int nselitems)
 {
+	struct Arena arena = { 0 };
 	int i;
 	char **argv;
+	char buf[PATH_MAX];
 	WidgetEvent retval;
 
 	argv = emalloc((nselitems + 3) * sizeof(*argv));
 	argv[0] = CONTEXTCMD;
 	argv[1] = cmd;
 	for (i = 0; i < nselitems; i++)
-		argv[i+2] = fm->entries[fm->selitems[i]].fullname;
+		argv[i+2] = arenastrdup(&arena, entrypath(fm, fm->selitems[i], buf));
 	argv[i+2] = NULL;
 	retval = runxfilesctl(fm, argv, NULL);
 	free(argv);
+	arenafree(&arena);
 	return retval;
 }
 
 static WidgetEvent
 runindrop(struct FM *fm, WidgetEvent event, int nitems)
 {
+	struct Arena arena = { 0 };
 	int i;
 	char **argv;
-	char *path;
+	char path[PATH_MAX];
+	char buf[PATH_MAX];
 	WidgetEvent retval;
 
 	/*
@@ -731,7 +3283,7 @@ runindrop(struct FM *fm, WidgetEvent event, int nitems)
 	 * fm->selitems[0] is the path where the files have been dropped
 	 * into.  The other items are the files being dropped.
 	 */
-	path = fm->entries[fm->selitems[0]].fullname;
+	(void)entrypath(fm, fm->selitems[0], path);
 	if ((argv = malloc((nitems + 2) * sizeof(*argv))) == NULL)
 		return WIDGET_NONE;
 	argv[0] = CONTEXTCMD;
@@ -742,10 +3294,11 @@ runindrop(struct FM *fm, WidgetEvent event, int nitems)
 	default:              argv[1] = DROPASK;  break;
 	}
 	for (i = 1; i < nitems; i++)
-		argv[i + 1] = fm->entries[fm->selitems[i]].fullname;
+		argv[i + 1] = arenastrdup(&arena, entrypath(fm, fm->selitems[i], buf));
 	argv[nitems + 1] = NULL;
 	retval = runxfilesctl(fm, argv, path);
 	free(argv);
+	arenafree(&arena);
 	return retval;
 }
 
@@ -837,8 +3390,9 @@ static int
 changedir(struct FM *fm, const char *path, int force_refresh)
 {
 	Scroll *scrl;
-	struct stat sb;
+	struct timespec time;
 	int keepscroll, retval;
+	bool unread, unverified;
 	struct Cwd cwd = {
 		.prev = NULL,
 		.next = NULL,
@@ -849,20 +3403,43 @@ changedir(struct FM *fm, const char *path, int force_refresh)
 	if (!force_refresh && fm->last != NULL && path == fm->last->path) {
 		/*
 		 * We're cd'ing to the place we are currently at; only
-		 * continue if the directory's ctime has changed
+		 * continue if the directory cannot be updated in place.
+		 * If it is still being read, let it be; the changes are
+		 * got (from inotify(7), or from its ctime) next time.
 		 */
-		if (stat(path, &sb) == -1) {
+		if (fm->load.running)
+			return RETURN_SUCCESS;
+		switch (dirupdate(fm)) {
+		case UPDATE_ERROR:
 			return RETURN_FAILURE;
-		}
-		if (!timespeclt(&fm->time, &sb.st_ctim)) {
+		case UPDATE_DONE:
 			return RETURN_SUCCESS;
+		default:
+			break;
 		}
 	}
 	widget_busy(fm->widget);
 	retval = RETURN_SUCCESS;
-	closethumbthread(fm);
-	if (diropen(fm, &cwd, path) == RETURN_FAILURE)
+	unread = closeloader(fm);
+	unverified = closerevalidator(fm) || unread;
+	metasave(fm);
+	time = fm->time;
+	if (diropen(fm, &cwd, path) == RETURN_FAILURE) {
+		/*
+		 * We stay where we are, even if main() has already moved
+		 * fm->cwd along the history.  If its entries were still
+		 * being read, closeloader() has freed them; read them
+		 * again rather than leave the widget with freed entries.
+		 */
+		if (fm->last != NULL)
+			fm->cwd = fm->last;
+		if (unread)
+			retval = dirload(fm, &fm->cwd->scrl);
 		goto done;
+	}
+	if (!unverified && fm->last != NULL && fm->last->path != NULL &&
+	    strcmp(cwd.path, fm->last->path) != 0)
+		snapsave(fm, fm->last->path, &time);
 	if (fm->cwd->path != NULL && strcmp(cwd.path, fm->cwd->path) == 0) {
 		/*
 		 * We're changing to the directory we currently are.
@@ -891,14 +3468,11 @@ changedir(struct FM *fm, const char *path, int force_refresh)
 	fm->cwd->here = cwd.here;
 	fm->last = fm->cwd;
 	scrl = keepscroll ? &fm->cwd->scrl : NULL;
-	retval = widget_set(
-		fm->widget,
-		fm->cwd->path,
-		fm->cwd->here,
-		fm->entries,
-		fm->nentries,
-		scrl
-	);
+	prefetchtake(fm);
+	if (snaprestore(fm, scrl) == RETURN_FAILURE &&
+	    metaload(fm, scrl) == RETURN_FAILURE)
+		retval = dirload(fm, scrl);
+	snaptrim(fm);
 done:
 	createthumbthread(fm);
 	return retval;
@@ -996,19 +3570,235 @@ error:
 	return;
 }
 
+static int
+charclass(int c)
+{
+	if (c >= '0' && c <= '9')
+		return 1;
+	if (c >= 'a' && c <= 'z')
+		return 2;
+	if (c >= 'A' && c <= 'Z')
+		return 3;
+	return 0;
+}
+
+static bool
+isextglob(const char *t)
+{
+	size_t i;
+	bool inbracket;
+
+	/*
+	 * Check whether t is "*." followed by a glob that never matches
+	 * a dot, such as "*.mp[23]" or "*.[1-9]"; such a pattern matches
+	 * a name with an extension depending only on the extension.  Be
+	 * conservative: allow only ASCII letters and digits, bracket
+	 * expressions that are not negated, and ranges between two
+	 * digits or two letters of the same case.
+	 */
+	if (t[0] != '*' || t[1] != '.')
+		return false;
+	inbracket = false;
+	for (i = 2; t[i] != '\0'; i++) {
+		if (charclass(t[i]) != 0) {
+			continue;
+		} else if (t[i] == '[' && !inbracket) {
+			if (t[i + 1] == '!' || t[i + 1] == '^')
+				return false;
+			inbracket = true;
+		} else if (t[i] == ']' && inbracket) {
+			inbracket = false;
+		} else if (t[i] != '-' || !inbracket || t[i - 1] == '[' ||
+		           charclass(t[i - 1]) == 0 ||
+		           charclass(t[i - 1]) != charclass(t[i + 1])) {
+			return false;
+		}
+	}
+	return !inbracket;
+}
+
+static void
+compilerule(struct IconMatcher *m, struct IconRule *rule, struct IconPatt *patt)
+{
+	size_t i, len, nstars;
+	char *t, *lit;
+
+	rule->patt = patt;
+	rule->next = NULL;
+	rule->lit = NULL;
+	rule->len = 0;
+	rule->shape = SHAPE_GLOB;
+	rule->byext = false;
+	if ((t = patt->patt) == NULL)
+		return;
+	if (t[0] == '~' || strchr(t, '/') != NULL)
+		return;
+	len = strlen(t);
+	nstars = 0;
+	for (i = 0; i < len; i++) {
+		if ((unsigned char)t[i] >= 128)
+			return;
+		if (strchr("?[\\", t[i]) != NULL) {
+			rule->byext = isextglob(t);
+			return;
+		}
+		if (t[i] == '*')
+			nstars++;
+	}
+	if (nstars == 0) {
+		rule->shape = SHAPE_NAME;
+		lit = t;
+	} else if (nstars == 1 && len == 1) {
+		rule->shape = SHAPE_ANY;
+		rule->byext = true;
+		return;
+	} else if (nstars == 1 && t[0] == '*' && t[1] == '.' && strchr(t + 2, '.') == NULL) {
+		rule->shape = SHAPE_EXT;
+		rule->byext = true;
+		lit = t + 2;
+	} else if (nstars == 1 && t[0] == '*') {
+		/* a suffix with no dot is in the extension, if any */
+		rule->shape = SHAPE_SUFFIX;
+		rule->byext = strchr(t + 1, '.') == NULL;
+		lit = t + 1;
+	} else if (nstars == 1 && t[len - 1] == '*') {
+		rule->shape = SHAPE_PREFIX;
+		lit = t;
+		len--;
+	} else {
+		return;
+	}
+	len -= lit - t;
+	if ((rule->lit = malloc(len + 1)) == NULL) {
+		rule->shape = SHAPE_GLOB;
+		rule->byext = false;
+		return;
+	}
+	for (i = 0; i < len; i++)
+		rule->lit[i] = m->fold[(unsigned char)lit[i]];
+	rule->lit[len] = '\0';
+	rule->len = len;
+}
+
+static void
+addrule(struct IconMatcher *m, struct IconRule **table, struct IconRule *rule)
+{
+	struct IconRule **p;
+
+	/* append, so rules in a bucket keep their order */
+	for (p = &table[hashlit(rule->lit, rule->len) & (m->nbuckets - 1)]; *p != NULL; p = &(*p)->next)
+		;
+	*p = rule;
+}
+
+static void
+freeicons(struct IconMatcher *m)
+{
+	size_t i;
+
+	for (i = 0; m->rules != NULL && i < m->nrules; i++)
+		free(m->rules[i].lit);
+	free(m->rules);
+	free(m->exts);
+	free(m->names);
+	free(m->extrules);
+	free(m->others);
+	m->rules = NULL;
+	m->exts = m->names = m->extrules = m->others = NULL;
+	m->nrules = m->nbuckets = m->nextrules = m->nothers = 0;
+	memset(m->cache, 0, sizeof(m->cache));
+#ifdef DEBUG
+	if (m->hits + m->misses > 0)
+		warnx("icon cache: %lu hits, %lu misses", m->hits, m->misses);
+	m->hits = m->misses = 0;
+#endif
+}
+
+static void
+compileicons(struct FM *fm)
+{
+	struct IconMatcher *m;
+	struct IconRule *rule;
+	size_t i;
+	int c, f;
+
+	/*
+	 * Compile the user-defined and hardcoded icon patterns, so
+	 * geticon() need not fnmatch(3) each name against all of them.
+	 * Most patterns are a file extension ("*.c") or an exact name
+	 * ("README"), which are looked up in hash tables of their case
+	 * folded literals; patterns of other shapes are kept in lists
+	 * and tried in order, and globs are still left to fnmatch(3).
+	 * Patterns matching a name by its extension alone go in a list
+	 * of their own, whose result geticon() can remember.
+	 *
+	 * If this fails, geticon() falls back to the linear scan.
+	 */
+	m = &fm->icons;
+	for (c = 0; c < 128; c++) {
+		/*
+		 * ASCII letters folding into non-ASCII ones (such as
+		 * 'I' in Turkish locales) fold into something that no
+		 * other character folds into, as in fnmatch(3).
+		 */
+		f = (MB_CUR_MAX == 1) ? tolower(c) : (int)towlower(c);
+		m->fold[c] = (f >= 0 && f < 128) ? f : c | 0x80;
+	}
+	m->nrules = fm->nuserpatts + nicon_patts;
+	for (m->nbuckets = 16; m->nbuckets < m->nrules * 2; m->nbuckets *= 2)
+		;
+	m->rules = calloc(m->nrules, sizeof(*m->rules));
+	m->exts = calloc(m->nbuckets, sizeof(*m->exts));
+	m->names = calloc(m->nbuckets, sizeof(*m->names));
+	m->extrules = calloc(m->nrules, sizeof(*m->extrules));
+	m->others = calloc(m->nrules, sizeof(*m->others));
+	if (m->rules == NULL || m->exts == NULL || m->names == NULL ||
+	    m->extrules == NULL || m->others == NULL) {
+		warn("could not compile file icons");
+		freeicons(m);
+		return;
+	}
+	for (i = 0; i < m->nrules; i++) {
+		rule = &m->rules[i];
+		if (i < fm->nuserpatts)
+			compilerule(m, rule, &fm->userpatts[i]);
+		else
+			compilerule(m, rule, &icon_patts[i - fm->nuserpatts]);
+		if (rule->shape == SHAPE_EXT)
+			addrule(m, m->exts, rule);
+		else if (rule->shape == SHAPE_NAME)
+			addrule(m, m->names, rule);
+		else if (rule->byext)
+			m->extrules[m->nextrules++] = rule;
+		else
+			m->others[m->nothers++] = rule;
+	}
+}
+
 static void
 freefm(struct FM *fm)
 {
 	size_t i;
 
 	clearcwd(fm->hist);
-	freeentries(fm);
-	free(fm->entries);
+	while (fm->snaphead != NULL)
+		snapfree(fm, fm->snaphead);
+	if (fm->dirfd != -1)
+		(void)close(fm->dirfd);
+	if (fm->watchfd != -1)
+		(void)close(fm->watchfd);
+	free(fm->thumbpending);
+	thumbdirdrop(fm->thumbdir);
+	freedir(&fm->dir);
+	free(fm->viewbuf);
+	free(fm->viewmap);
 	free(fm->selitems);
 	free(fm->thumbnaildir);
+	free(fm->metadir);
 	for (i = 0; i < fm->nuserpatts; i++)
 		free(fm->userpatts[i].patt);
 	free(fm->userpatts);
+	freeicons(&fm->icons);
 }
 
 int
@@ -1017,7 +3807,7 @@ main(int argc, char *argv[])
 	struct FM fm;
 	struct Cwd *cwd;
 	int ch, nitems;
-	int saveargc, force_refresh;
+	int saveargc;
 	int nresources = 0;
 	int exitval = EXIT_SUCCESS;
 	const char *resources[MAX_RESOURCES];
@@ -1026,6 +3816,7 @@ main(int argc, char *argv[])
 	char *home = NULL;
 	char **saveargv;
 	char *text;
+	char pathbuf[PATH_MAX];
 	WidgetEvent event;
 
 	saveargv = argv;
@@ -1046,15 +3837,38 @@ main(int argc, char *argv[])
 		nresources++;
 	fm = (struct FM){
 		.cwd = emalloc(sizeof(*fm.cwd)),
+		.dirfd = -1,
+		.watchfd = -1,
+		.watch = -1,
 		.home = home,
 		.homelen = ((home != NULL) ? strlen(home) : 0),
 		.uid = getuid(),
 		.gid = getgid(),
 		.thumblock = PTHREAD_MUTEX_INITIALIZER,
+		.thumbdrawlock = PTHREAD_MUTEX_INITIALIZER,
+		.thumbcond = PTHREAD_COND_INITIALIZER,
+		.prefetch = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.cond = PTHREAD_COND_INITIALIZER,
+		},
+		.reval = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.dirfd = -1,
+		},
+		.load = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+		},
+		.icons = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+		},
 	};
 	(*fm.cwd) = (struct Cwd){ 0 };
 	fm.hist = fm.cwd;
 	fm.ngrps = getgroups(NGROUPS_MAX, fm.grps);
+#ifdef __linux__
+	if ((fm.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		warn("inotify_init1");
+#endif
 	if ((fm.opener = getenv("OPENER")) == NULL)
 		fm.opener = DEF_OPENER;
 	while ((ch = getopt(argc, argv, "aN:X:")) != -1) {
@@ -1085,18 +3899,27 @@ main(int argc, char *argv[])
 	if ((fm.widget = widget_create(APPCLASS, name, saveargc, saveargv, resources)) == NULL)
 		exit(EXIT_FAILURE);
 	fm.widgetfd = widget_fd(fm.widget);
+	initmetacache(&fm);
 #if __OpenBSD__
-	if (pledge("stdio rpath proc exec", NULL) == RETURN_FAILURE)
+	/* the metadata cache is written by ourselves */
+	if (pledge(fm.metadir != NULL ? "stdio rpath wpath cpath proc exec"
+	                              : "stdio rpath proc exec", NULL) == RETURN_FAILURE)
 		err(EXIT_FAILURE, "pledge");
 #endif
 	inituserpatts(&fm);
+	compileicons(&fm);
+	initdircache(&fm);
+	initthumbjobs(&fm);
+	initprefetcher(&fm);
 	if (diropen(&fm, fm.cwd, path) == RETURN_FAILURE)
 		goto error;
 	fm.last = fm.cwd;
-	if (widget_set(fm.widget, fm.cwd->path, fm.cwd->here, fm.entries, fm.nentries, NULL) == RETURN_FAILURE)
+	widget_map(fm.widget);
+	widget_busy(fm.widget);
+	if (metaload(&fm, NULL) == RETURN_FAILURE &&
+	    dirload(&fm, NULL) == RETURN_FAILURE)
 		goto error;
 	createthumbthread(&fm);
-	widget_map(fm.widget);
 	text = NULL;
 	while ((event = widget_poll(fm.widget, fm.selitems, &nitems, &fm.cwd->scrl, &text)) != WIDGET_CLOSE) {
 		if (event == WIDGET_GOTO && strcmp(text, "-") == 0)
@@ -1133,15 +3956,15 @@ main(int argc, char *argv[])
 		case WIDGET_OPEN:
 			if (nitems < 1)
 				break;
-			if (fm.selitems[0] < 0 || fm.selitems[0] >= fm.nentries)
+			if (fm.selitems[0] < 0 || fm.selitems[0] >= fm.nview)
 				break;
-			if (isdir(&fm.entries[fm.selitems[0]])) {
-				if (changedir(&fm, fm.entries[fm.selitems[0]].fullname, false) == RETURN_FAILURE) {
+			if (isdir(&fm.view[fm.selitems[0]])) {
+				if (changedir(&fm, entrypath(&fm, fm.selitems[0], pathbuf), false) == RETURN_FAILURE) {
 					exitval = EXIT_FAILURE;
 					goto done;
 				}
 			} else {
-				fileopen(&fm, fm.entries[fm.selitems[0]].fullname);
+				fileopen(&fm, entrypath(&fm, fm.selitems[0], pathbuf));
 			}
 			break;
 		case WIDGET_DROPASK:
@@ -1150,14 +3973,14 @@ main(int argc, char *argv[])
 		case WIDGET_DROPLINK:
 			if (text != NULL) {
 				/* drag-and-drop between different windows */
-				if (nitems > 0 && (fm.selitems[0] < 0 || fm.selitems[0] >= fm.nentries))
+				if (nitems > 0 && (fm.selitems[0] < 0 || fm.selitems[0] >= fm.nview))
 					path = NULL;
 				else
-					path = fm.entries[fm.selitems[0]].fullname;
+					path = entrypath(&fm, fm.selitems[0], pathbuf);
 				if (runexdrop(&fm, event, text, path) == WIDGET_CLOSE) {
 					goto done;
 				}
-			} else if (nitems > 1 && isdir(&fm.entries[fm.selitems[0]])) {
+			} else if (nitems > 1 && isdir(&fm.view[fm.selitems[0]])) {
 				/* drag-and-drop in the same window */
 				if (runindrop(&fm, event, nitems) == WIDGET_CLOSE) {
 					goto done;
@@ -1171,13 +3994,12 @@ main(int argc, char *argv[])
 		case WIDGET_KEYPRESS:
 			if (strcmp(text, "^period") == 0) {
 				hide = !hide;
-				force_refresh = true;
-			} else {
-				if (runcontext(&fm, text, nitems) == WIDGET_CLOSE)
-					goto done;
-				force_refresh = false;
+				filterentries(&fm);
+				break;
 			}
-			if (changedir(&fm, fm.cwd->path, force_refresh) == RETURN_FAILURE) {
+			if (runcontext(&fm, text, nitems) == WIDGET_CLOSE)
+				goto done;
+			if (changedir(&fm, fm.cwd->path, false) == RETURN_FAILURE) {
 				exitval = EXIT_FAILURE;
 				goto done;
 			}
@@ -1188,6 +4010,11 @@ main(int argc, char *argv[])
 				goto done;
 			}
 			break;
+		case WIDGET_WAKEUP:
+			revalidatetake(&fm);
+			if (loadtake(&fm))
+				createthumbthread(&fm);
+			break;
 		default:
 			break;
 		}
@@ -1195,7 +4022,11 @@ main(int argc, char *argv[])
 	}
 done:
 	closethumbthread(&fm);
+	metasave(&fm);
 error:
+	(void)closerevalidator(&fm);
+	(void)closeloader(&fm);
+	closeprefetcher(&fm);
 	freefm(&fm);
 	widget_free(fm.widget);
 	return exitval;